@@ -0,0 +1,79 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Header-only helper for applications: calling bootloader_request_update()
+ * writes a magic value to a backup data register and resets the device,
+ * so that the bootloader stays resident in USB MSC mode instead of
+ * starting the application again. Backup registers survive a system reset
+ * but not a power cycle (unless VBAT is supplied), and the bootloader
+ * clears the magic once it has seen it.
+ *
+ * Only raw register addresses are used, so that this header can be
+ * included with or without libopencm3 or CMSIS.
+ */
+
+#ifndef __BOOTLOADER_REQUEST_H
+#define __BOOTLOADER_REQUEST_H
+
+#include <stdint.h>
+
+/* Backup data register 10, 16-bit wide */
+#define BOOTLOADER_REQUEST_REG  (*(volatile uint32_t *) 0x40006C28)
+
+#define BOOTLOADER_REQUEST_MAGIC 0x4D53         /* "MS" */
+
+/* RCC_APB1ENR, PWREN and BKPEN bits */
+#define BOOTLOADER_REQUEST_APB1ENR (*(volatile uint32_t *) 0x4002101C)
+#define BOOTLOADER_REQUEST_PWREN (1 << 28)
+#define BOOTLOADER_REQUEST_BKPEN (1 << 27)
+
+/* PWR_CR, DBP (disable backup domain write protection) bit */
+#define BOOTLOADER_REQUEST_PWR_CR (*(volatile uint32_t *) 0x40007000)
+#define BOOTLOADER_REQUEST_DBP  (1 << 8)
+
+/* SCB_AIRCR, its key, PRIGROUP field and SYSRESETREQ bit */
+#define BOOTLOADER_REQUEST_AIRCR (*(volatile uint32_t *) 0xE000ED0C)
+#define BOOTLOADER_REQUEST_VECTKEY 0x05FA0000
+#define BOOTLOADER_REQUEST_PRIGROUP 0x00000700
+#define BOOTLOADER_REQUEST_SYSRESETREQ (1 << 2)
+
+static inline void bootloader_request_write(uint16_t value)
+{
+    BOOTLOADER_REQUEST_APB1ENR |= BOOTLOADER_REQUEST_PWREN |
+	BOOTLOADER_REQUEST_BKPEN;
+    BOOTLOADER_REQUEST_PWR_CR |= BOOTLOADER_REQUEST_DBP;
+    BOOTLOADER_REQUEST_REG = value;
+    BOOTLOADER_REQUEST_PWR_CR &= ~BOOTLOADER_REQUEST_DBP;
+}
+
+static inline void bootloader_request_update(void)
+    __attribute__ ((noreturn));
+
+static inline void bootloader_request_update(void)
+{
+    bootloader_request_write(BOOTLOADER_REQUEST_MAGIC);
+    __asm__ volatile ("dsb");
+    BOOTLOADER_REQUEST_AIRCR = BOOTLOADER_REQUEST_VECTKEY |
+	(BOOTLOADER_REQUEST_AIRCR & BOOTLOADER_REQUEST_PRIGROUP) |
+	BOOTLOADER_REQUEST_SYSRESETREQ;
+    while (1);
+}
+
+#endif
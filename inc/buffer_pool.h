@@ -0,0 +1,70 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Static pool of fixed-size RAM buffers shared by the USB transfer, the
+ * flash page slots, the staging page and the external flash sector buffer,
+ * so that each of them only holds memory while it actually buffers data.
+ * A request for several buffers gets a contiguous run of them. Allocation
+ * and release take a constant time, whatever the pool size.
+ */
+
+#ifndef __BUFFER_POOL_H
+#define __BUFFER_POOL_H
+
+#include <stdint.h>
+
+/* Size of a pool buffer, a logical block */
+#define BUFFER_SIZE             512
+
+/* Number of pool buffers, at most 32. The default covers the USB transfer
+ * buffer and the flash page slots, 1 + 2 * FLASH_PAGE_SLOTS. An external
+ * SPI NOR flash (USE_SPI_NOR or USE_SPI_NOR_STAGING) needs 8 more for its
+ * sector buffer, the staging page fitting in the flash page slots share.
+ */
+#define BUFFER_POOL_COUNT       9
+/* #define BUFFER_POOL_COUNT    17 */
+
+/* Stage holding a buffer */
+enum buffer_owner {
+    BUFFER_FREE,
+    BUFFER_USB,
+    BUFFER_PAGE_SLOT,
+    BUFFER_STAGING,
+    BUFFER_SPI_NOR,
+    BUFFER_OWNERS
+};
+
+/* Buffers in use, in total and by owner, with their high-water marks, and
+ * the number of failed allocations
+ */
+struct buffer_pool_stats {
+    uint8_t in_use;
+    uint8_t high_water;
+    uint8_t owned[BUFFER_OWNERS];
+    uint8_t owned_high_water[BUFFER_OWNERS];
+    uint16_t failures;
+};
+
+extern uint8_t *buffer_alloc(uint8_t count, enum buffer_owner owner);
+extern void buffer_release(uint8_t *buffer);
+extern void buffer_pool_reclaim(int (*reclaim)(void));
+extern const struct buffer_pool_stats *buffer_pool_stats(void);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLASH_ENGINE_H
+#define __FLASH_ENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sha256.h"
+#include "spi_nor.h"
+#include "pipeline.h"
+
+/* --- Memory Layout ------------------------------------------------------- */
+
+#define FLASH_ORIGIN            0x08000000
+#define FLASH_SIZE              (64 * 1024)
+/* #define FLASH_SIZE           (128 * 1024) */
+#define MSC_BOOTLOADER_SIZE     (8 * 1024)
+#define MSC_FIRMWARE_SIZE       (FLASH_SIZE - MSC_BOOTLOADER_SIZE)
+
+/* The application vector table immediately follows the bootloader */
+#define MSC_FIRMWARE_ORIGIN     (FLASH_ORIGIN + MSC_BOOTLOADER_SIZE)
+
+#define RAM_ORIGIN              0x20000000
+#define RAM_SIZE                (20 * 1024)
+
+/* Flash page size (1KB on low and medium density devices) */
+#define FLASH_PAGE_SIZE         1024
+
+/* Size of the blocks read and written through the flash engine */
+#define FLASH_BLOCK_SIZE        512
+
+/* The last flash page holds the verified image record */
+#define IMAGE_RECORD_ORIGIN     (FLASH_ORIGIN + FLASH_SIZE - FLASH_PAGE_SIZE)
+
+/* Size of the application image area, up to the verified image record */
+#define MSC_IMAGE_SIZE          (IMAGE_RECORD_ORIGIN - MSC_FIRMWARE_ORIGIN)
+
+/* Number of pages kept in RAM before being programmed */
+#define FLASH_PAGE_SLOTS        4
+
+/* Idle time after the last write before the cached pages are written back
+ * (an update is only committed on eject) */
+#define FLASH_COMMIT_IDLE_MS    1000
+
+/* Idle time after the last write before discarded pages are erased */
+#define FLASH_ERASE_IDLE_MS     10
+
+/* --- External Flash Staging ---------------------------------------------- */
+
+/* Stage updates in an external SPI NOR flash (see spi_nor.h), and only copy
+ * them to the application area once complete and verified, so that an
+ * aborted upload leaves the current application untouched.
+ */
+/* #define USE_SPI_NOR_STAGING */
+
+/* Staging area, at the end of the external flash: the image, rounded up to
+ * whole erase sectors, then a sector holding its staging record, which has
+ * the same layout as the verified image record.
+ */
+#define STAGING_IMAGE_SIZE      ((MSC_IMAGE_SIZE + SPI_NOR_SECTOR_SIZE - 1) & \
+				 ~(SPI_NOR_SECTOR_SIZE - 1))
+#define STAGING_SIZE            (STAGING_IMAGE_SIZE + SPI_NOR_SECTOR_SIZE)
+#define STAGING_RECORD_MAGIC    0x47415453      /* "STAG" */
+
+/* --- Verified Image Record ----------------------------------------------- */
+
+/* The record is written once the update has been committed and the image
+ * validated. Its magic is zeroed (the only value that can be programmed
+ * over a non-erased flash half-word) as soon as the application area is
+ * about to be modified, so that an interrupted update is never booted.
+ * The magic is programmed last, so that a torn record reads as erased.
+ */
+#define IMAGE_RECORD_MAGIC      0x49524556      /* "VERI" */
+#define IMAGE_RECORD_ERASED     0xFFFFFFFF
+#define IMAGE_RECORD_INVALID    0x00000000
+
+struct image_record {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t length;
+    uint32_t crc;
+    uint32_t check;
+};
+
+#define IMAGE_RECORD ((const struct image_record *) IMAGE_RECORD_ORIGIN)
+
+/* --- Image Digest -------------------------------------------------------- */
+
+/* The CRC is a CRC-32/MPEG-2 over little-endian 32-bit words, as computed
+ * by the CRC unit, the same as in the verified image record.
+ */
+struct image_digest {
+    uint32_t length;
+    uint32_t crc;
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+};
+
+extern int flash_engine_init(void);
+extern int flash_engine_read(uint32_t offset, uint8_t *block);
+extern int flash_engine_write(uint32_t offset, const uint8_t *block);
+extern int flash_engine_write_direct(uint32_t offset, const uint8_t *block);
+extern int flash_engine_flush(void);
+extern int flash_engine_unmap(uint32_t offset, uint32_t length);
+extern uint32_t flash_engine_crc(uint32_t offset, uint32_t length);
+extern int flash_engine_commit(void);
+extern uint32_t flash_engine_image_length(void);
+extern bool flash_engine_tick(void);
+extern bool flash_engine_changed(void);
+extern bool flash_engine_image_is_bootable(void);
+extern const struct image_digest *flash_engine_digest(void);
+extern uint32_t flash_engine_staging_size(void);
+extern int flash_engine_journal_open(uint32_t key);
+extern bool flash_engine_journal_page(uint32_t offset, uint32_t *crc);
+extern int flash_engine_push(const struct pipeline_stage *stage,
+			     uint32_t offset, const uint8_t *data,
+			     uint32_t length);
+extern uint8_t *flash_engine_claim(const struct pipeline_stage *stage,
+				   uint32_t offset);
+
+#endif
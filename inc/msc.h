@@ -0,0 +1,104 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * USB Mass Storage Class Bulk-Only Transport with a SCSI command set,
+ * derived from the libopencm3 usb_msc driver, which does not handle the
+ * commands needed to commit an update when the host ejects the medium.
+ */
+
+#ifndef __MSC_H
+#define __MSC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/msc.h>
+#include "pipeline.h"
+
+/* Size of a logical block */
+#define MSC_BLOCK_SIZE          512
+
+/* Vendor specific fast-flash commands, addressed in bytes from the start
+ * of a flash area and bypassing the file system
+ */
+struct msc_flash {
+	uint32_t size;
+	uint32_t erase_size;
+	int (*write)(uint32_t offset, const uint8_t *block);
+	int (*erase)(uint32_t offset, uint32_t length);
+	uint32_t (*crc)(uint32_t offset, uint32_t length);
+	void (*reboot)(void);
+
+	/* Progress journal of resumable uploads, NULL if not supported:
+	 * journal_open() opens the journal of the upload identified by a
+	 * host key, returning 1 if the upload resumes, 0 if it starts anew
+	 * and -1 on error. journal_page() gets the CRC of an erase unit
+	 * programmed since the journal was started.
+	 */
+	int (*journal_open)(uint32_t key);
+	bool (*journal_page)(uint32_t offset, uint32_t *crc);
+};
+
+/* Logical unit backing store */
+struct msc_lun {
+	uint32_t block_count;
+	int (*read_block)(uint32_t lba, uint8_t *copy_to);
+
+	/* Write path the written blocks are pushed into, in bytes from the
+	 * start of the unit
+	 */
+	const struct pipeline_stage *write_pipeline;
+
+	/* Write back the cached blocks, NULL if writes are not cached */
+	int (*flush)(void);
+
+	/* Discard the contents of a range of blocks, NULL if UNMAP is not
+	 * supported
+	 */
+	int (*unmap)(uint32_t lba, uint32_t count);
+
+	/* Optimal transfer length granularity (the erase unit) and optimal
+	 * transfer length in blocks, reported in the Block Limits VPD page,
+	 * 0 if not reported. No maximum transfer length is reported, as any
+	 * length is streamed.
+	 */
+	uint16_t granularity;
+	uint32_t optimal_transfer;
+
+	/* Fast-flash commands, NULL if not supported */
+	const struct msc_flash *flash;
+
+	/* Called once the CSW of a START STOP UNIT with LoEj set and Start
+	 * cleared has been queued, NULL if the medium cannot be ejected.
+	 */
+	void (*eject)(void);
+};
+
+extern usbd_mass_storage *msc_init(usbd_device *usbd_dev,
+				   uint8_t ep_in, uint8_t ep_in_size,
+				   uint8_t ep_out, uint8_t ep_out_size,
+				   const char *vendor_id,
+				   const char *product_id,
+				   const char *product_revision_level,
+				   const struct msc_lun *luns,
+				   uint8_t lun_count);
+extern void msc_medium_changed(usbd_mass_storage *ms, uint8_t lun);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write path pipeline: the blocks written by the host flow through a chain
+ * of stages, each taking them by reference and passing them on to the next
+ * one, or consuming them. A chain is made of constant stage descriptors
+ * linked at build time, so a stage that no configuration lists is not even
+ * linked in. The last stages may also lend the buffer a block is to be
+ * received into, so that the block reaches them without being copied.
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Count the bytes pushed into each stage and the CPU cycles spent in it,
+ * excluding the next stages, with the DWT cycle counter. The counts are
+ * read with the PIPELINE STATS vendor command.
+ */
+/* #define USE_PIPELINE_PROFILE */
+
+/* Stage identifiers, for the profile: the USB packet reception, then the
+ * pipeline stages
+ */
+enum pipeline_stage_id {
+    PIPELINE_RECEIVE,
+    PIPELINE_FAT,
+    PIPELINE_PROGRAM,
+    PIPELINE_SPI_NOR,
+    PIPELINE_STAGES
+};
+
+struct pipeline_stage {
+    enum pipeline_stage_id id;
+
+    /* Process length bytes (whole blocks) at offset, in bytes from the
+     * start of the stream the stage consumes. Returns -1 on error.
+     */
+    int (*push)(const struct pipeline_stage *stage, uint32_t offset,
+		const uint8_t *data, uint32_t length);
+
+    /* Lend the buffer the block at offset can be received into, which is
+     * then pushed back as is, or return NULL. NULL if the stage never
+     * lends buffers, e.g. because it transforms the data.
+     */
+    uint8_t *(*claim)(const struct pipeline_stage *stage, uint32_t offset);
+
+    /* Next stage, NULL for the last one */
+    const struct pipeline_stage *next;
+};
+
+struct pipeline_profile {
+    uint32_t bytes;
+    uint32_t cycles;
+};
+
+static inline uint8_t *pipeline_claim(const struct pipeline_stage *stage,
+				      uint32_t offset)
+{
+    return stage->claim != NULL ? stage->claim(stage, offset) : NULL;
+}
+
+#ifdef USE_PIPELINE_PROFILE
+extern int pipeline_push(const struct pipeline_stage *stage, uint32_t offset,
+			 const uint8_t *data, uint32_t length);
+extern void pipeline_profile_begin(void);
+extern void pipeline_profile_end(enum pipeline_stage_id id, uint32_t length);
+extern const struct pipeline_profile *pipeline_profile(void);
+#else
+static inline int pipeline_push(const struct pipeline_stage *stage,
+				uint32_t offset, const uint8_t *data,
+				uint32_t length)
+{
+    return stage->push(stage, offset, data, length);
+}
+
+#define pipeline_profile_begin()
+#define pipeline_profile_end(id, length)
+#endif
+
+#endif
@@ -21,14 +21,8 @@
 #define __PSEUDO_FAT_H
 
 #include <stdint.h>
-
-#define FLASH_SIZE              (64 * 1024)
-/* #define FLASH_SIZE           (128 * 1024) */
-#define MSC_BOOTLOADER_SIZE     (8 * 1024)
-#define MSC_FIRMWARE_SIZE       (FLASH_SIZE - MSC_BOOTLOADER_SIZE)
-
-/* Size of the RAM data */
-#define RAM_DATA_SIZE           (16 * 1024)
+#include "flash_engine.h"
+#include "trace.h"
 
 /* --- FAT definitions ----------------------------------------------------- */
 
@@ -43,17 +37,25 @@
 /* Number of bytes per sector */
 #define BYTES_PER_SECTOR        512
 
-/* Number of sectors per cluster */
-#define SECTORS_PER_CLUSTER     4
+/* Number of sectors per cluster, so that a cluster is a flash page */
+#define SECTORS_PER_CLUSTER     (FLASH_PAGE_SIZE / BYTES_PER_SECTOR)
 
-/* Number of reserved sectors (including boot sector) */
-#define RESERVED_SECTORS        1
+/* Number of reserved sectors (including boot sector), padded so that the
+ * data region starts on a flash page boundary
+ */
+#define RESERVED_SECTORS        (1 + (SECTORS_PER_CLUSTER - \
+                                      (1 + FAT_SECTORS + ROOT_DIR_SECTORS) % \
+                                      SECTORS_PER_CLUSTER) % \
+                                 SECTORS_PER_CLUSTER)
 
 /* Number of FATs  */
 #define NUMBER_OF_FATS          2
 
-/* Count of root directory entries */
-#define ROOT_ENTRY_COUNT        512
+/* Count of root directory entries: only a couple of them are used, and
+ * hosts read the whole root directory at mount time. This must be a
+ * multiple of BYTES_PER_SECTOR / DIR_ENTRY_SIZE.
+ */
+#define ROOT_ENTRY_COUNT        32
 
 /* Media is fixed disk */
 #define FIXED_DISK              0xF8
@@ -82,9 +84,22 @@
 /* File data start cluster number */
 #define FIRST_CLUSTER           3
 
+/* Last cluster of the firmware pseudo-file */
+#define LAST_CLUSTER            (FIRST_CLUSTER - 1 + MSC_IMAGE_SIZE / \
+                                 (SECTORS_PER_CLUSTER * BYTES_PER_SECTOR))
+
 /* Number of FAT sectors */
 #define FAT_SECTORS             (NUMBER_OF_FATS * FAT_SIZE)
 
+/* First FAT copy sector */
+#define FAT1_SECTOR             RESERVED_SECTORS
+
+/* Second FAT copy sector */
+#define FAT2_SECTOR             (RESERVED_SECTORS + FAT_SIZE)
+
+/* Root directory first sector */
+#define ROOT_DIR_SECTOR         (RESERVED_SECTORS + FAT_SECTORS)
+
 /* Number of root directory sectors, rounded up */
 #define ROOT_DIR_SECTORS        (((ROOT_ENTRY_COUNT * DIR_ENTRY_SIZE) + \
                                   (BYTES_PER_SECTOR - 1)) / \
@@ -94,18 +109,48 @@
 #define FIRST_DATA_SECTOR       (RESERVED_SECTORS + FAT_SECTORS + \
                                  ROOT_DIR_SECTORS)
 
+/* The checksum pseudo-file uses the first data cluster */
+#define CHECKSUM_CLUSTER        2
+
+/* Checksum pseudo-file sector */
+#define CHECKSUM_SECTOR         (FIRST_DATA_SECTOR + \
+                                 (CHECKSUM_CLUSTER - 2) * SECTORS_PER_CLUSTER)
+
 /* Actual file data start sector */
 #define FILEDATA_START_SECTOR   (FIRST_DATA_SECTOR + \
                                  (FIRST_CLUSTER - 2) * SECTORS_PER_CLUSTER)
-/* File data sector count */
-#define FILEDATA_SECTOR_COUNT   (RAM_DATA_SIZE / BYTES_PER_SECTOR)
+/* File data sector count: the whole application area, up to the verified
+ * image record
+ */
+#define FILEDATA_SECTOR_COUNT   (MSC_IMAGE_SIZE / BYTES_PER_SECTOR)
 
 /* File data end sector */
-#define FILEDATA_END_SECTOR     (FIRST_DATA_SECTOR + FILEDATA_SECTOR_COUNT)
+#define FILEDATA_END_SECTOR     (FILEDATA_START_SECTOR + FILEDATA_SECTOR_COUNT)
+
+/* The read-only trace pseudo-file, if enabled, follows the firmware one */
+#ifdef USE_TRACE
+#define TRACE_CLUSTER           (LAST_CLUSTER + 1)
+#define TRACE_LAST_CLUSTER      (LAST_CLUSTER + TRACE_SIZE / \
+				 (SECTORS_PER_CLUSTER * BYTES_PER_SECTOR))
+#define TRACE_SECTOR_COUNT      (TRACE_SIZE / BYTES_PER_SECTOR)
+#else
+#define TRACE_LAST_CLUSTER      LAST_CLUSTER
+#define TRACE_SECTOR_COUNT      0
+#endif
+
+/* Trace pseudo-file sectors */
+#define TRACE_START_SECTOR      FILEDATA_END_SECTOR
+#define TRACE_END_SECTOR        (TRACE_START_SECTOR + TRACE_SECTOR_COUNT)
 
 /* Total sectors */
 #define TOTAL_SECTORS           (FILEDATA_START_SECTOR + \
-				 (MSC_FIRMWARE_SIZE / BYTES_PER_SECTOR))
+				 FILEDATA_SECTOR_COUNT + TRACE_SECTOR_COUNT)
+
+/* Directory entry first name byte of a free entry, past the last entry,
+ * and of a deleted entry
+ */
+#define DIR_NAME_FREE           0x00
+#define DIR_NAME_DELETED        0xE5
 
 /* Directory entry attributes */
 #define ATTR_READ_ONLY		0x01
@@ -152,6 +197,11 @@
 
 extern int pseudo_fat_init(void);
 extern int pseudo_fat_read(uint32_t lba, uint8_t *copy_to);
-extern int pseudo_fat_write(uint32_t lba, const uint8_t *copy_from);
+extern int pseudo_fat_push(const struct pipeline_stage *stage, uint32_t offset,
+			   const uint8_t *data, uint32_t length);
+extern uint8_t *pseudo_fat_claim(const struct pipeline_stage *stage,
+				 uint32_t offset);
+extern int pseudo_fat_flush(void);
+extern int pseudo_fat_unmap(uint32_t lba, uint32_t count);
 
 #endif
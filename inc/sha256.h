@@ -0,0 +1,41 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_BLOCK_SIZE       64
+#define SHA256_DIGEST_SIZE      32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint32_t count;
+    uint8_t block[SHA256_BLOCK_SIZE];
+};
+
+extern void sha256_init(struct sha256_ctx *ctx);
+extern void sha256_update(struct sha256_ctx *ctx, const uint8_t *data,
+			  size_t length);
+extern void sha256_final(struct sha256_ctx *ctx,
+			 uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * External SPI NOR flash (W25Qxx and compatible) on SPI1, with DMA data
+ * transfers: SCK on PA5, MISO on PA6, MOSI on PA7 and chip select on PA4.
+ */
+
+#ifndef __SPI_NOR_H
+#define __SPI_NOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pipeline.h"
+
+/* Erase unit, the size of the RAM write-back buffer */
+#define SPI_NOR_SECTOR_SIZE     4096
+
+/* Program unit */
+#define SPI_NOR_PAGE_SIZE       256
+
+/* Size of the blocks read and written through the logical unit */
+#define SPI_NOR_BLOCK_SIZE      512
+
+/* Idle time after the last write before the buffered sector is written */
+#define SPI_NOR_FLUSH_IDLE_MS   100
+
+extern int spi_nor_init(void);
+extern uint32_t spi_nor_size(void);
+extern int spi_nor_read(uint32_t offset, uint8_t *data, uint32_t length);
+extern int spi_nor_write(uint32_t offset, const uint8_t *block);
+extern int spi_nor_flush(void);
+extern void spi_nor_tick(void);
+extern int spi_nor_read_block(uint32_t lba, uint8_t *block);
+extern int spi_nor_push(const struct pipeline_stage *stage, uint32_t offset,
+			const uint8_t *data, uint32_t length);
+
+#endif
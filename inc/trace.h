@@ -0,0 +1,109 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event trace: timestamped events of the USB transfers, the SCSI commands
+ * and the flash operations are logged into a RAM ring buffer, which the
+ * host reads back as the read-only TRACE.BIN file of the firmware drive,
+ * and tools/msc-trace converts to the Chrome trace event format.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+/* Log the events and expose them as TRACE.BIN */
+/* #define USE_TRACE */
+
+/* Size of the ring buffer and of TRACE.BIN, a multiple of the flash page
+ * size, as the file takes whole clusters
+ */
+#define TRACE_SIZE              4096
+
+/* Size of the blocks TRACE.BIN is read in */
+#define TRACE_BLOCK_SIZE        512
+
+/* Time after the last read of TRACE.BIN before logging resumes, should the
+ * host not read it to the end */
+#define TRACE_PAUSE_MS          1000
+
+/* CPU clock, the unit of the timestamps */
+#define TRACE_CLOCK_HZ          72000000
+
+#define TRACE_MAGIC             0x45435254      /* "TRCE" */
+#define TRACE_VERSION           1
+
+/* Events, with their arguments */
+enum trace_event {
+    TRACE_USB_OUT = 1,          /* endpoint, packet length */
+    TRACE_USB_IN,               /* endpoint, packet length */
+    TRACE_CBW,                  /* LUN, tag, data transfer length */
+    TRACE_CSW,                  /* status, tag, data residue */
+    TRACE_SCSI,                 /* opcode, LBA and length in blocks of a
+				 * 10-byte CDB */
+    TRACE_ERASE_BEGIN,          /* -, address */
+    TRACE_ERASE_END,            /* -, address */
+    TRACE_PROGRAM_BEGIN,        /* -, address */
+    TRACE_PROGRAM_END,          /* -, address */
+    TRACE_NAK_BEGIN,            /* endpoint, LBA */
+    TRACE_NAK_END               /* endpoint, LBA */
+};
+
+/* TRACE.BIN starts with this header, in place of the first entry, then
+ * holds the ring buffer entries, all little-endian. The total number of
+ * events logged tells which entries are valid and which is the oldest.
+ */
+struct trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t clock_hz;
+    uint32_t total;
+};
+
+struct trace_entry {
+
+    /* CPU cycle counter */
+    uint32_t time;
+    uint8_t event;
+    uint8_t reserved;
+    uint16_t arg;
+    uint32_t a;
+    uint32_t b;
+};
+
+#define TRACE_ENTRIES           (TRACE_SIZE / sizeof (struct trace_entry) - 1)
+
+#ifdef USE_TRACE
+#define TRACE(event, arg, a, b) trace_log(event, arg, a, b)
+
+extern void trace_init(void);
+extern void trace_log(enum trace_event event, uint16_t arg, uint32_t a,
+		      uint32_t b);
+extern void trace_read(uint32_t offset, uint8_t *sector);
+extern void trace_resume(void);
+extern void trace_tick(void);
+#else
+#define TRACE(event, arg, a, b) ((void) 0)
+#define trace_init()
+#define trace_tick()
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include "buffer_pool.h"
+
+#if BUFFER_POOL_COUNT > 32
+#error "The buffer pool bitmap holds at most 32 buffers"
+#endif
+
+/* Longest run of buffers that can be requested at once */
+#define BUFFER_RUN_MAX          8
+
+static uint8_t pool[BUFFER_POOL_COUNT][BUFFER_SIZE]
+    __attribute__ ((aligned (4)));
+
+/* Bitmap of the free buffers */
+static uint32_t free_buffers = (uint32_t) ((1ULL << BUFFER_POOL_COUNT) - 1);
+
+/* Owner and length of each allocated run, indexed by its first buffer */
+static uint8_t run_owner[BUFFER_POOL_COUNT];
+static uint8_t run_length[BUFFER_POOL_COUNT];
+
+static struct buffer_pool_stats stats;
+
+/* Writes back and releases cached buffers when an allocation fails */
+static int (*reclaim_buffers)(void);
+
+static void stats_update(enum buffer_owner owner, int count)
+{
+    stats.in_use += count;
+    stats.owned[owner] += count;
+    if (stats.in_use > stats.high_water) {
+	stats.high_water = stats.in_use;
+    }
+    if (stats.owned[owner] > stats.owned_high_water[owner]) {
+	stats.owned_high_water[owner] = stats.owned[owner];
+    }
+}
+
+/*
+ * Bitmap of the first buffers of the free runs of count buffers, found with
+ * a bounded number of bitmap operations: a bit left set after and-ing the
+ * free bitmap with its shifts by 1 to count - 1 is the first buffer of a
+ * free run.
+ */
+static uint32_t free_runs(uint8_t count)
+{
+    uint32_t runs = free_buffers;
+    int i;
+
+    for (i = 1; i < count; i++) {
+	runs &= free_buffers >> i;
+    }
+    return runs;
+}
+
+/*
+ * Allocate a run of count contiguous buffers, or return NULL if there is
+ * none free, even once the cached buffers have been reclaimed.
+ */
+uint8_t *buffer_alloc(uint8_t count, enum buffer_owner owner)
+{
+    uint32_t runs;
+    int index;
+
+    if (count == 0 || count > BUFFER_RUN_MAX) {
+	return NULL;
+    }
+    runs = free_runs(count);
+    if (runs == 0 && reclaim_buffers != NULL) {
+	reclaim_buffers();
+	runs = free_runs(count);
+    }
+    if (runs == 0) {
+	stats.failures++;
+	return NULL;
+    }
+    index = __builtin_ctz(runs);
+    free_buffers &= ~(((1UL << count) - 1) << index);
+    run_owner[index] = owner;
+    run_length[index] = count;
+    stats_update(owner, count);
+    return pool[index];
+}
+
+static int buffer_index(const uint8_t *buffer)
+{
+    return (buffer - pool[0]) / BUFFER_SIZE;
+}
+
+void buffer_release(uint8_t *buffer)
+{
+    int index;
+    int count;
+
+    if (buffer == NULL) {
+	return;
+    }
+    index = buffer_index(buffer);
+    count = run_length[index];
+    stats_update(run_owner[index], -count);
+    run_owner[index] = BUFFER_FREE;
+    run_length[index] = 0;
+    free_buffers |= ((1UL << count) - 1) << index;
+}
+
+/*
+ * Set the function called when an allocation fails, to write back the
+ * buffers holding cached data and release them, before trying again. A
+ * large run, such as the external flash sector buffer, may otherwise not
+ * be found in a pool fragmented by the page slots.
+ */
+void buffer_pool_reclaim(int (*reclaim)(void))
+{
+    reclaim_buffers = reclaim;
+}
+
+const struct buffer_pool_stats *buffer_pool_stats(void)
+{
+    return &stats;
+}
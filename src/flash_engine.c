@@ -0,0 +1,1188 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include "flash_engine.h"
+#include "buffer_pool.h"
+#include "trace.h"
+
+/* --- Page Write-Back Slots ----------------------------------------------- */
+
+/* Number of blocks in a flash page */
+#define PAGE_BLOCKS             (FLASH_PAGE_SIZE / FLASH_BLOCK_SIZE)
+
+/* Block bitmap of a fully valid page */
+#define PAGE_FULL               ((1 << PAGE_BLOCKS) - 1)
+
+/* Number of pool buffers holding a page */
+#define PAGE_BUFFERS            (FLASH_PAGE_SIZE / BUFFER_SIZE)
+
+/* Written pages are kept in RAM until they are evicted by a write to
+ * another page, or flushed on commit, so that hosts rewriting the last
+ * partial cluster of a file, or the same page several times in a row,
+ * do not cost an extra page erase each time. The page buffers are taken
+ * from the buffer pool, and given back once programmed.
+ */
+struct page_slot {
+    uint8_t *data;
+
+    /* Address of the buffered page, 0 if the slot is free */
+    uint32_t address;
+
+    /* Bitmap of the valid blocks in the buffered page */
+    uint32_t blocks;
+
+    /* Value of use_count when the page was last written */
+    uint32_t last_use;
+};
+
+static struct page_slot slots[FLASH_PAGE_SLOTS];
+static uint32_t use_count;
+
+/* A slot part has been lent by flash_engine_claim() and the block received
+ * in it has not been pushed yet: the slots must then not be written back
+ * and released in the background, however long the host stalls. A block
+ * abandoned by a reset of the transport is forgotten by the next flush.
+ */
+static bool claim_pending;
+
+/* --- Page Bitmaps -------------------------------------------------------- */
+
+/* Number of pages in the application image area */
+#define IMAGE_PAGES             (MSC_IMAGE_SIZE / FLASH_PAGE_SIZE)
+
+#define PAGE_BITMAP_SIZE        ((IMAGE_PAGES + 31) / 32)
+
+/* Bitmap of the application area pages known to be erased, so that reads
+ * of these pages are served without touching the flash
+ */
+static uint32_t blank_pages[PAGE_BITMAP_SIZE];
+
+/* Bitmap of the application area pages discarded by the host, to be
+ * erased in the background when the bus is idle
+ */
+static uint32_t erase_pages[PAGE_BITMAP_SIZE];
+
+static bool page_test(const uint32_t *bitmap, uint32_t offset)
+{
+    uint32_t page = offset / FLASH_PAGE_SIZE;
+
+    return page < IMAGE_PAGES && (bitmap[page / 32] & (1UL << (page % 32)));
+}
+
+static void page_mark(uint32_t *bitmap, uint32_t offset, bool set)
+{
+    uint32_t page = offset / FLASH_PAGE_SIZE;
+
+    if (set) {
+	bitmap[page / 32] |= 1UL << (page % 32);
+    } else {
+	bitmap[page / 32] &= ~(1UL << (page % 32));
+    }
+}
+
+static bool page_is_blank(uint32_t offset)
+{
+    return page_test(blank_pages, offset);
+}
+
+static void page_set_blank(uint32_t offset, const uint8_t *data)
+{
+    const uint32_t *words = (const uint32_t *) data;
+    int i;
+
+    for (i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+	if (words[i] != 0xFFFFFFFF) {
+	    page_mark(blank_pages, offset, false);
+	    return;
+	}
+    }
+    page_mark(blank_pages, offset, true);
+}
+
+/* --- Update Session ------------------------------------------------------ */
+
+/* The application area has been modified since the last commit */
+static bool image_dirty;
+
+/* Length of the image, up to its last non-erased word */
+static uint32_t image_length;
+static bool image_length_valid;
+
+/* Milliseconds elapsed since the last write */
+static uint32_t idle_ms;
+
+/* The pages cached since the last write have been written back */
+static bool idle_flushed;
+
+/* The application area has changed behind the host page cache, through
+ * the fast-flash commands or the discarded pages
+ */
+static bool contents_changed;
+
+/* Image digest, cached until the next write */
+static struct image_digest digest;
+static bool digest_valid;
+
+static uint32_t record_check(const struct image_record *record)
+{
+    return ~(record->magic ^ record->sequence ^ record->length ^ record->crc);
+}
+
+/*
+ * Check that the application vector table looks sane: the initial stack
+ * pointer must lie within SRAM and the reset vector must be a Thumb
+ * address inside the application region.
+ */
+static bool vectors_are_valid(const uint32_t *vectors)
+{
+    uint32_t sp = vectors[0];
+    uint32_t pc = vectors[1];
+
+    return sp > RAM_ORIGIN && sp <= RAM_ORIGIN + RAM_SIZE &&
+	(pc & 1) &&
+	pc > MSC_FIRMWARE_ORIGIN && pc < IMAGE_RECORD_ORIGIN;
+}
+
+static int flash_status(void)
+{
+    uint32_t status = flash_get_status_flags();
+
+    flash_clear_status_flags();
+    return (status & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) ? -1 : 0;
+}
+
+/* Zero the record magic before the first change to the application area */
+static int image_invalidate(void)
+{
+    if (image_dirty) {
+	return 0;
+    }
+    image_dirty = true;
+    if (IMAGE_RECORD->magic == IMAGE_RECORD_INVALID) {
+	return 0;
+    }
+    flash_unlock();
+    flash_program_word(IMAGE_RECORD_ORIGIN, IMAGE_RECORD_INVALID);
+    flash_lock();
+    return flash_status();
+}
+
+/* --- Progress Journal ---------------------------------------------------- */
+
+/* While an update is in progress, the rest of the image record page holds
+ * a journal of the programmed pages with their CRCs, so that a fast-flash
+ * upload interrupted by a reset or a cable pull is resumed by the host
+ * from the first missing page. The journal is identified by a key given by
+ * the host (e.g. the image CRC), and is erased with the record page when
+ * the update is committed.
+ */
+struct journal_entry {
+    uint32_t crc;
+
+    /* Page index, with its complement in the upper half-word, programmed
+     * after the CRC so that a torn entry is ignored
+     */
+    uint32_t page;
+};
+
+#define JOURNAL_ORIGIN          (IMAGE_RECORD_ORIGIN + 64)
+#define JOURNAL_KEY             (*(const uint32_t *) JOURNAL_ORIGIN)
+#define JOURNAL                 ((const struct journal_entry *) \
+				 (JOURNAL_ORIGIN + 8))
+#define JOURNAL_ENTRIES         ((IMAGE_RECORD_ORIGIN + FLASH_PAGE_SIZE - \
+				  JOURNAL_ORIGIN - 8) / \
+				 sizeof (struct journal_entry))
+
+/* A journal has been opened by the host for the current update */
+static bool journal_active;
+
+static uint32_t journal_tag(uint32_t page)
+{
+    return page | (~page << 16);
+}
+
+/* Append the CRC of a page that has just been erased or programmed */
+static void journal_record(uint32_t offset)
+{
+    const struct journal_entry *entry = JOURNAL;
+    uint32_t page = offset / FLASH_PAGE_SIZE;
+    uint32_t crc;
+
+    if (!journal_active) {
+	return;
+    }
+    while (entry < JOURNAL + JOURNAL_ENTRIES &&
+	   (entry->crc != 0xFFFFFFFF || entry->page != 0xFFFFFFFF)) {
+	entry++;
+    }
+
+    /* Once the journal is full, the next pages are simply not listed */
+    if (entry == JOURNAL + JOURNAL_ENTRIES) {
+	return;
+    }
+    crc_reset();
+    crc = crc_calculate_block((uint32_t *) (MSC_FIRMWARE_ORIGIN + offset),
+			      FLASH_PAGE_SIZE / 4);
+    flash_unlock();
+    flash_program_word((uint32_t) &entry->crc, crc);
+    flash_program_word((uint32_t) &entry->page, journal_tag(page));
+    flash_lock();
+    flash_status();
+}
+
+static struct page_slot *slot_find(uint32_t page)
+{
+    int i;
+
+    for (i = 0; i < FLASH_PAGE_SLOTS; i++) {
+	if (slots[i].address == page) {
+	    return &slots[i];
+	}
+    }
+    return NULL;
+}
+
+static bool slots_pending(void)
+{
+    int i;
+
+    for (i = 0; i < FLASH_PAGE_SLOTS; i++) {
+	if (slots[i].address != 0) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * Complete a buffered page with the blocks that have not been written,
+ * which are only read from the flash when actually needed, so that a
+ * fully written page is never read back.
+ */
+static void slot_fill(struct page_slot *slot)
+{
+    bool blank = page_is_blank(slot->address - MSC_FIRMWARE_ORIGIN);
+    int i;
+
+    for (i = 0; i < PAGE_BLOCKS; i++) {
+	uint8_t *block = slot->data + i * FLASH_BLOCK_SIZE;
+
+	if (slot->blocks & (1 << i)) {
+	    continue;
+	}
+	if (blank) {
+	    memset(block, 0xFF, FLASH_BLOCK_SIZE);
+	} else {
+	    memcpy(block, (const void *) (slot->address + i * FLASH_BLOCK_SIZE),
+		   FLASH_BLOCK_SIZE);
+	}
+    }
+    slot->blocks = PAGE_FULL;
+}
+
+static int slot_flush(struct page_slot *slot)
+{
+    const uint16_t *flash = (const uint16_t *) slot->address;
+    const uint16_t *buffer = (const uint16_t *) slot->data;
+    bool erase = false;
+    bool program = false;
+    int i;
+
+    if (slot->address == 0) {
+	return 0;
+    }
+    slot_fill(slot);
+
+    /* A flash half-word can only be programmed when erased, or to zero */
+    for (i = 0; i < FLASH_PAGE_SIZE / 2; i++) {
+	if (flash[i] != buffer[i]) {
+	    program = true;
+	    if (flash[i] != 0xFFFF && buffer[i] != 0) {
+		erase = true;
+		break;
+	    }
+	}
+    }
+    if (program) {
+	if (image_invalidate() < 0) {
+	    return -1;
+	}
+	flash_unlock();
+	if (erase) {
+	    TRACE(TRACE_ERASE_BEGIN, 0, slot->address, 0);
+	    flash_erase_page(slot->address);
+	    TRACE(TRACE_ERASE_END, 0, slot->address, 0);
+	}
+	TRACE(TRACE_PROGRAM_BEGIN, 0, slot->address, 0);
+	for (i = 0; i < FLASH_PAGE_SIZE / 2; i++) {
+	    if (flash[i] != buffer[i]) {
+		flash_program_half_word(slot->address + i * 2, buffer[i]);
+	    }
+	}
+	TRACE(TRACE_PROGRAM_END, 0, slot->address, 0);
+	flash_lock();
+	page_set_blank(slot->address - MSC_FIRMWARE_ORIGIN, slot->data);
+	journal_record(slot->address - MSC_FIRMWARE_ORIGIN);
+    }
+    buffer_release(slot->data);
+    slot->data = NULL;
+    slot->address = 0;
+    slot->blocks = 0;
+    return flash_status();
+}
+
+static int slots_flush(void)
+{
+    int status = 0;
+    int i;
+
+    for (i = 0; i < FLASH_PAGE_SLOTS; i++) {
+	if (slot_flush(&slots[i]) < 0) {
+	    status = -1;
+	}
+    }
+    return status;
+}
+
+/*
+ * Get a slot for a page, evicting the least recently written one. When
+ * the buffer pool is short, all the pages are written back to make room
+ * (see flash_engine_init()).
+ */
+static struct page_slot *slot_get(uint32_t page)
+{
+    struct page_slot *slot = slot_find(page);
+    int i;
+
+    if (slot != NULL) {
+	return slot;
+    }
+    slot = &slots[0];
+    for (i = 0; i < FLASH_PAGE_SLOTS && slot->address != 0; i++) {
+	if (slots[i].address == 0 ||
+	    slots[i].last_use - slot->last_use > (uint32_t) INT32_MAX) {
+	    slot = &slots[i];
+	}
+    }
+    if (slot_flush(slot) < 0) {
+	return NULL;
+    }
+    slot->data = buffer_alloc(PAGE_BUFFERS, BUFFER_PAGE_SLOT);
+    if (slot->data == NULL) {
+	return NULL;
+    }
+    slot->address = page;
+    return slot;
+}
+
+/* --- External Flash Staging ---------------------------------------------- */
+
+#define IMAGE_BLOCKS            (MSC_IMAGE_SIZE / FLASH_BLOCK_SIZE)
+
+#define BLOCK_BITMAP_SIZE       ((IMAGE_BLOCKS + 31) / 32)
+
+/* An external flash large enough for the staging area has been found */
+#ifdef USE_SPI_NOR_STAGING
+static bool staging;
+#else
+static const bool staging = false;
+#endif
+
+/* Offset of the staging area in the external flash */
+static uint32_t staging_origin;
+
+/* The application area has been written to the staging area since the
+ * last commit
+ */
+static bool staging_dirty;
+
+/* Bitmap of the application area blocks held by the staging area */
+static uint32_t staged_blocks[BLOCK_BITMAP_SIZE];
+
+/* Scratch page buffer, taken from the pool once staging is enabled */
+static uint8_t *staging_buffer;
+
+static bool block_is_staged(uint32_t offset)
+{
+    uint32_t block = offset / FLASH_BLOCK_SIZE;
+
+    return (staged_blocks[block / 32] & (1UL << (block % 32))) != 0;
+}
+
+static void block_set_staged(uint32_t offset, bool set)
+{
+    uint32_t block = offset / FLASH_BLOCK_SIZE;
+
+    if (set) {
+	staged_blocks[block / 32] |= 1UL << (block % 32);
+    } else {
+	staged_blocks[block / 32] &= ~(1UL << (block % 32));
+    }
+}
+
+static bool page_is_staged(uint32_t offset)
+{
+    int i;
+
+    for (i = 0; i < PAGE_BLOCKS; i++) {
+	if (block_is_staged(offset + i * FLASH_BLOCK_SIZE)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+static void page_unstage(uint32_t offset)
+{
+    int i;
+
+    for (i = 0; i < PAGE_BLOCKS; i++) {
+	block_set_staged(offset + i * FLASH_BLOCK_SIZE, false);
+    }
+}
+
+/*
+ * Contents of a block of the staged image: from the staging area if the
+ * host wrote it, erased if the host discarded its page, or else the same
+ * as in the application area.
+ */
+static int staging_read(uint32_t offset, uint8_t *block)
+{
+    if (block_is_staged(offset)) {
+	return spi_nor_read(staging_origin + offset, block, FLASH_BLOCK_SIZE);
+    }
+    if (page_is_blank(offset) || page_test(erase_pages, offset)) {
+	memset(block, 0xFF, FLASH_BLOCK_SIZE);
+    } else {
+	memcpy(block, (const void *) (MSC_FIRMWARE_ORIGIN + offset),
+	       FLASH_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/* Zero the staging record, so that the staging area is not copied again */
+static int staging_record_clear(void)
+{
+    memset(staging_buffer, 0, FLASH_BLOCK_SIZE);
+    return spi_nor_write(staging_origin + STAGING_IMAGE_SIZE, staging_buffer);
+}
+
+/* Start staging an update, the staging record of the previous one is
+ * zeroed before the staging area is modified
+ */
+static int staging_begin(void)
+{
+    if (staging_dirty) {
+	return 0;
+    }
+    staging_dirty = true;
+    return staging_record_clear();
+}
+
+static int staging_write(uint32_t offset, const uint8_t *block)
+{
+    if (staging_begin() < 0 ||
+	spi_nor_write(staging_origin + offset, block) < 0) {
+	return -1;
+    }
+    block_set_staged(offset, true);
+    return 0;
+}
+
+/* Drop the staged update, the application area contents show again */
+static void staging_discard(void)
+{
+    staging_dirty = false;
+    memset(staged_blocks, 0, sizeof (staged_blocks));
+    memset(erase_pages, 0, sizeof (erase_pages));
+    digest_valid = false;
+    image_length_valid = false;
+}
+
+/* Contents of a page of the application area, including pending writes */
+static const uint8_t *page_data(uint32_t offset)
+{
+    uint32_t page = MSC_FIRMWARE_ORIGIN + offset;
+    struct page_slot *slot = slot_find(page);
+    int i;
+
+    if (staging_dirty) {
+	for (i = 0; i < PAGE_BLOCKS; i++) {
+	    staging_read(offset + i * FLASH_BLOCK_SIZE,
+			 staging_buffer + i * FLASH_BLOCK_SIZE);
+	}
+	return staging_buffer;
+    }
+    if (slot == NULL) {
+	return (const uint8_t *) page;
+    }
+    slot_fill(slot);
+    return slot->data;
+}
+
+/*
+ * CRC-32 of a word aligned range of the flash area, including pending
+ * writes, computed by the CRC unit.
+ */
+uint32_t flash_engine_crc(uint32_t offset, uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t end = offset + length;
+
+    crc_reset();
+    while (offset < end) {
+	uint32_t index = offset & (FLASH_PAGE_SIZE - 1);
+	uint32_t size = FLASH_PAGE_SIZE - index;
+
+	if (size > end - offset) {
+	    size = end - offset;
+	}
+	crc = crc_calculate_block((uint32_t *) (page_data(offset - index) +
+						index), size / 4);
+	offset += size;
+    }
+    return crc;
+}
+
+static int record_write(uint32_t length, uint32_t crc)
+{
+    struct image_record record;
+
+    record.magic = IMAGE_RECORD_MAGIC;
+    record.sequence = IMAGE_RECORD->sequence + 1;
+    record.length = length;
+    record.crc = crc;
+    record.check = record_check(&record);
+
+    flash_unlock();
+    flash_erase_page(IMAGE_RECORD_ORIGIN);
+    flash_program_word(IMAGE_RECORD_ORIGIN + 4, record.sequence);
+    flash_program_word(IMAGE_RECORD_ORIGIN + 8, record.length);
+    flash_program_word(IMAGE_RECORD_ORIGIN + 12, record.crc);
+    flash_program_word(IMAGE_RECORD_ORIGIN + 16, record.check);
+    flash_program_word(IMAGE_RECORD_ORIGIN, record.magic);
+    flash_lock();
+    return flash_status();
+}
+
+/*
+ * Find the end of the image by scanning the application area backwards
+ * for the last non-erased word, stopping in the first page that is not
+ * blank.
+ */
+static uint32_t image_scan_length(void)
+{
+    uint32_t offset;
+
+    for (offset = MSC_IMAGE_SIZE; offset > 0; offset -= FLASH_PAGE_SIZE) {
+	const uint32_t *words;
+	int i = FLASH_PAGE_SIZE / 4;
+
+	if (page_is_blank(offset - FLASH_PAGE_SIZE) &&
+	    slot_find(MSC_FIRMWARE_ORIGIN + offset - FLASH_PAGE_SIZE) == NULL &&
+	    !(staging_dirty && page_is_staged(offset - FLASH_PAGE_SIZE))) {
+	    continue;
+	}
+	words = (const uint32_t *) page_data(offset - FLASH_PAGE_SIZE);
+	while (i > 0 && words[i - 1] == 0xFFFFFFFF) {
+	    i--;
+	}
+	if (i > 0) {
+	    return offset - FLASH_PAGE_SIZE + i * 4;
+	}
+    }
+    return 0;
+}
+
+/* --- Staged Update Copy -------------------------------------------------- */
+
+/*
+ * Copy the staged image to the application area in one pass, check it and
+ * write its verified image record, then zero the staging record. If this
+ * is interrupted, the staging record is still valid and the copy is done
+ * again on the next boot.
+ */
+static int staging_apply(const struct image_record *staged)
+{
+    struct page_slot *slot;
+    uint32_t offset;
+
+    for (offset = 0; offset < MSC_IMAGE_SIZE; offset += FLASH_PAGE_SIZE) {
+	slot = slot_get(MSC_FIRMWARE_ORIGIN + offset);
+	if (slot == NULL ||
+	    spi_nor_read(staging_origin + offset, slot->data,
+			 FLASH_PAGE_SIZE) < 0) {
+	    return -1;
+	}
+	slot->blocks = PAGE_FULL;
+	if (slot_flush(slot) < 0) {
+	    return -1;
+	}
+    }
+    staging_discard();
+    if (flash_engine_crc(0, staged->length) != staged->crc) {
+	return -1;
+    }
+    if (record_write(staged->length, staged->crc) < 0) {
+	return -1;
+    }
+    image_dirty = false;
+    if (staging_record_clear() < 0 || spi_nor_flush() < 0) {
+	return -1;
+    }
+    return 1;
+}
+
+/*
+ * Complete the staging area with the blocks the host did not write, then
+ * validate the staged image and write its staging record before copying
+ * it. An image that fails validation is dropped, and the application area
+ * is left untouched.
+ */
+static int staging_commit(void)
+{
+    struct image_record record;
+    uint32_t offset;
+
+    for (offset = 0; offset < MSC_IMAGE_SIZE; offset += FLASH_BLOCK_SIZE) {
+	if (block_is_staged(offset)) {
+	    continue;
+	}
+	if (staging_read(offset, staging_buffer) < 0 ||
+	    spi_nor_write(staging_origin + offset, staging_buffer) < 0) {
+	    return -1;
+	}
+	block_set_staged(offset, true);
+    }
+    if (spi_nor_flush() < 0) {
+	return -1;
+    }
+    memset(erase_pages, 0, sizeof (erase_pages));
+    image_length_valid = false;
+    record.length = flash_engine_image_length();
+    record.crc = flash_engine_crc(0, record.length);
+    if (!vectors_are_valid((const uint32_t *) page_data(0))) {
+	staging_discard();
+	return -1;
+    }
+    record.magic = STAGING_RECORD_MAGIC;
+    record.sequence = 0;
+    record.check = record_check(&record);
+    memset(staging_buffer, 0xFF, FLASH_BLOCK_SIZE);
+    memcpy(staging_buffer, &record, sizeof (record));
+    if (spi_nor_write(staging_origin + STAGING_IMAGE_SIZE,
+		      staging_buffer) < 0 || spi_nor_flush() < 0) {
+	return -1;
+    }
+    return staging_apply(&record);
+}
+
+#ifdef USE_SPI_NOR_STAGING
+
+/*
+ * Copy again a staged image whose copy has been interrupted, once its
+ * contents have been checked against its staging record.
+ */
+static int staging_resume(void)
+{
+    struct image_record record;
+
+    if (spi_nor_read(staging_origin + STAGING_IMAGE_SIZE,
+		     (uint8_t *) &record, sizeof (record)) < 0 ||
+	record.magic != STAGING_RECORD_MAGIC ||
+	record.check != record_check(&record)) {
+	return 0;
+    }
+    staging_dirty = true;
+    memset(staged_blocks, 0xFF, sizeof (staged_blocks));
+    if (record.length > MSC_IMAGE_SIZE ||
+	flash_engine_crc(0, record.length) != record.crc) {
+	staging_discard();
+	return staging_record_clear() < 0 || spi_nor_flush() < 0 ? -1 : 0;
+    }
+    return staging_apply(&record);
+}
+
+#endif
+
+/* Size reserved at the end of the external flash for staging updates */
+uint32_t flash_engine_staging_size(void)
+{
+    return staging ? STAGING_SIZE : 0;
+}
+
+/*
+ * Returns 1 if an interrupted update has been completed from the staging
+ * area, and the new application can be started.
+ */
+int flash_engine_init(void)
+{
+    uint32_t offset;
+
+    /* Enable the CRC unit clock */
+    RCC_AHBENR |= RCC_AHBENR_CRCEN;
+
+    /* The page slots are written back when the buffer pool runs short */
+    buffer_pool_reclaim(slots_flush);
+
+    for (offset = 0; offset < MSC_IMAGE_SIZE; offset += FLASH_PAGE_SIZE) {
+	page_set_blank(offset,
+		       (const uint8_t *) MSC_FIRMWARE_ORIGIN + offset);
+    }
+#ifdef USE_SPI_NOR_STAGING
+    if (spi_nor_init() == 0 && spi_nor_size() >= STAGING_SIZE) {
+	staging_buffer = buffer_alloc(PAGE_BUFFERS, BUFFER_STAGING);
+	if (staging_buffer == NULL) {
+	    return -1;
+	}
+	staging = true;
+	staging_origin = spi_nor_size() - STAGING_SIZE;
+	return staging_resume();
+    }
+#endif
+    return 0;
+}
+
+int flash_engine_read(uint32_t offset, uint8_t *block)
+{
+    uint32_t address = MSC_FIRMWARE_ORIGIN + offset;
+    uint32_t index = address & (FLASH_PAGE_SIZE - 1);
+    struct page_slot *slot;
+
+    if (offset >= MSC_FIRMWARE_SIZE) {
+	return -1;
+    }
+    if (staging_dirty && offset < MSC_IMAGE_SIZE) {
+	return staging_read(offset, block);
+    }
+    slot = slot_find(address & ~(FLASH_PAGE_SIZE - 1));
+    if (slot != NULL && (slot->blocks & (1 << (index / FLASH_BLOCK_SIZE)))) {
+	memcpy(block, slot->data + index, FLASH_BLOCK_SIZE);
+    } else if (page_is_blank(offset)) {
+	memset(block, 0xFF, FLASH_BLOCK_SIZE);
+    } else {
+	memcpy(block, (const void *) address, FLASH_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+int flash_engine_write(uint32_t offset, const uint8_t *block)
+{
+    uint32_t address = MSC_FIRMWARE_ORIGIN + offset;
+    uint32_t page = address & ~(FLASH_PAGE_SIZE - 1);
+    uint32_t index = address & (FLASH_PAGE_SIZE - 1);
+    struct page_slot *slot;
+
+    /* The verified image record is not writable */
+    if (offset >= MSC_IMAGE_SIZE) {
+	return 0;
+    }
+    idle_ms = 0;
+    idle_flushed = false;
+    digest_valid = false;
+    if (staging) {
+	image_length_valid = false;
+	return staging_write(offset, block);
+    }
+    slot = slot_get(page);
+    if (slot == NULL) {
+	return -1;
+    }
+    page_mark(erase_pages, page - MSC_FIRMWARE_ORIGIN, false);
+
+    /* A block received in place by flash_engine_claim() is already there */
+    if (block != slot->data + index) {
+	memcpy(slot->data + index, block, FLASH_BLOCK_SIZE);
+    }
+    slot->blocks |= 1 << (index / FLASH_BLOCK_SIZE);
+    slot->last_use = ++use_count;
+    image_length_valid = false;
+    return 0;
+}
+
+/* Fast-flash write, bypassing the file system */
+int flash_engine_write_direct(uint32_t offset, const uint8_t *block)
+{
+    contents_changed = true;
+    return flash_engine_write(offset, block);
+}
+
+/* Last write path stage, programming the application area */
+int flash_engine_push(const struct pipeline_stage *stage, uint32_t offset,
+		      const uint8_t *data, uint32_t length)
+{
+    uint32_t i;
+
+    (void) stage;
+    claim_pending = false;
+    for (i = 0; i < length; i += FLASH_BLOCK_SIZE) {
+	if (flash_engine_write(offset + i, data + i) < 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Lend the page slot part where the block at offset goes, so that it is
+ * received there directly. Staged writes are still copied, as the external
+ * flash sector buffer must keep the previous contents until they are
+ * compared.
+ */
+uint8_t *flash_engine_claim(const struct pipeline_stage *stage,
+			    uint32_t offset)
+{
+    uint32_t address = MSC_FIRMWARE_ORIGIN + offset;
+    struct page_slot *slot;
+
+    (void) stage;
+    if (staging || offset >= MSC_IMAGE_SIZE) {
+	return NULL;
+    }
+
+    /* Keep the slot from being committed while the block is received */
+    idle_ms = 0;
+    idle_flushed = false;
+    slot = slot_get(address & ~(FLASH_PAGE_SIZE - 1));
+    if (slot == NULL) {
+	return NULL;
+    }
+    slot->last_use = ++use_count;
+    claim_pending = true;
+    return slot->data + (address & (FLASH_PAGE_SIZE - 1));
+}
+
+/*
+ * Program all the pages held in the write-back slots, without committing
+ * the update.
+ */
+int flash_engine_flush(void)
+{
+    claim_pending = false;
+    return staging ? spi_nor_flush() : slots_flush();
+}
+
+/*
+ * Flush the page slots, then validate the image and write its verified
+ * image record, so that later boots only need an O(1) check. An image
+ * that fails validation keeps its record invalidated, and the bootloader
+ * stays resident. Returns 1 if a new image has been committed, 0 if there
+ * was nothing to commit.
+ */
+int flash_engine_commit(void)
+{
+    uint32_t length;
+
+    claim_pending = false;
+    if (slots_flush() < 0) {
+	return -1;
+    }
+    if (staging_dirty) {
+	return staging_commit();
+    }
+    if (!image_dirty) {
+	return 0;
+    }
+    length = flash_engine_image_length();
+
+    /* The record page is rewritten, or the update is rejected: either way
+     * the journal ends here. The image stays dirty until its record is
+     * written, so that the next commit tries again.
+     */
+    journal_active = false;
+    if (!vectors_are_valid((const uint32_t *) MSC_FIRMWARE_ORIGIN) ||
+	record_write(length, flash_engine_crc(0, length)) < 0) {
+	return -1;
+    }
+    image_dirty = false;
+    return 1;
+}
+
+/*
+ * Length of the programmed image: the length stored in the verified image
+ * record as long as the application area is untouched, or else found by
+ * a blank tail scan. Either way, it is cached until the next write.
+ */
+uint32_t flash_engine_image_length(void)
+{
+    const struct image_record *record = IMAGE_RECORD;
+
+    if (!image_length_valid) {
+	if (!image_dirty && !slots_pending() && !staging_dirty &&
+	    record->magic == IMAGE_RECORD_MAGIC &&
+	    record->check == record_check(record)) {
+	    image_length = record->length;
+	} else {
+	    image_length = image_scan_length();
+	}
+	image_length_valid = true;
+    }
+    return image_length;
+}
+
+/*
+ * Discard the whole pages of a range of the application area: their write
+ * back slots are dropped, and they are queued for a background erase, so
+ * that a new image can then be programmed without any erase stall.
+ */
+int flash_engine_unmap(uint32_t offset, uint32_t length)
+{
+    uint32_t end = offset + length;
+
+    offset = (offset + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1);
+    if (end > MSC_IMAGE_SIZE) {
+	end = MSC_IMAGE_SIZE;
+    }
+    if (staging && staging_begin() < 0) {
+	return -1;
+    }
+    contents_changed = true;
+    idle_flushed = false;
+    for (; offset + FLASH_PAGE_SIZE <= end; offset += FLASH_PAGE_SIZE) {
+	struct page_slot *slot = slot_find(MSC_FIRMWARE_ORIGIN + offset);
+
+	/* A staged page is only erased when the update is copied */
+	if (staging) {
+	    page_unstage(offset);
+	    page_mark(erase_pages, offset, true);
+	    digest_valid = false;
+	    image_length_valid = false;
+	    continue;
+	}
+
+	if (slot != NULL) {
+	    buffer_release(slot->data);
+	    slot->data = NULL;
+	    slot->address = 0;
+	    slot->blocks = 0;
+	}
+	if (!page_is_blank(offset)) {
+	    page_mark(erase_pages, offset, true);
+	}
+    }
+    return 0;
+}
+
+/* Erase the first page queued for a background erase, if any */
+static bool erase_next_page(void)
+{
+    uint32_t offset;
+
+    if (staging) {
+	return false;
+    }
+    for (offset = 0; offset < MSC_IMAGE_SIZE; offset += FLASH_PAGE_SIZE) {
+	if (page_test(erase_pages, offset)) {
+	    page_mark(erase_pages, offset, false);
+	    if (image_invalidate() < 0) {
+		return true;
+	    }
+	    flash_unlock();
+	    TRACE(TRACE_ERASE_BEGIN, 0, MSC_FIRMWARE_ORIGIN + offset, 0);
+	    flash_erase_page(MSC_FIRMWARE_ORIGIN + offset);
+	    TRACE(TRACE_ERASE_END, 0, MSC_FIRMWARE_ORIGIN + offset, 0);
+	    flash_lock();
+	    flash_status();
+	    page_set_blank(offset,
+			   (const uint8_t *) MSC_FIRMWARE_ORIGIN + offset);
+	    journal_record(offset);
+	    digest_valid = false;
+	    image_length_valid = false;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * Called every millisecond from the main loop, doing nothing while a block
+ * is received in a lent slot. Pages queued for a background erase are
+ * erased first, one per tick. Once the bus has been
+ * idle for FLASH_COMMIT_IDLE_MS, the cached pages are written back, and
+ * true is returned once if an update is pending. The update is not
+ * committed here: a host that merely stalls, or a cable pulled in the
+ * middle of the copy, must not get a truncated image marked bootable.
+ */
+bool flash_engine_tick(void)
+{
+    if (++idle_ms < FLASH_ERASE_IDLE_MS || claim_pending ||
+	erase_next_page()) {
+	return false;
+    }
+    if (idle_ms < FLASH_COMMIT_IDLE_MS || idle_flushed ||
+	!(image_dirty || slots_pending() || staging_dirty)) {
+	return false;
+    }
+    idle_flushed = true;
+    flash_engine_flush();
+    return true;
+}
+
+/*
+ * Returns true once after the application area has been changed behind the
+ * host page cache, so that the host is told to drop it.
+ */
+bool flash_engine_changed(void)
+{
+    bool changed = contents_changed;
+
+    contents_changed = false;
+    return changed;
+}
+
+/*
+ * O(1) boot check, called from the reset handler before the .data/.bss
+ * initialization: it must not use any static variable.
+ */
+bool flash_engine_image_is_bootable(void)
+{
+    const struct image_record *record = IMAGE_RECORD;
+
+    switch (record->magic) {
+    case IMAGE_RECORD_MAGIC:
+	if (record->check != record_check(record)) {
+	    return false;
+	}
+	break;
+
+    case IMAGE_RECORD_ERASED:
+
+	/* No record, e.g. an application programmed through SWD */
+	break;
+
+    default:
+
+	/* An update was started and never committed */
+	return false;
+    }
+    return vectors_are_valid((const uint32_t *) MSC_FIRMWARE_ORIGIN);
+}
+
+/*
+ * Compute the image digest on demand, using the CRC unit and SHA-256, and
+ * cache it until the next write to the application area.
+ */
+const struct image_digest *flash_engine_digest(void)
+{
+    struct sha256_ctx ctx;
+    uint32_t offset;
+
+    if (digest_valid) {
+	return &digest;
+    }
+    digest.length = flash_engine_image_length();
+    digest.crc = flash_engine_crc(0, digest.length);
+    sha256_init(&ctx);
+    for (offset = 0; offset < digest.length; offset += FLASH_PAGE_SIZE) {
+	uint32_t size = digest.length - offset;
+
+	if (size > FLASH_PAGE_SIZE) {
+	    size = FLASH_PAGE_SIZE;
+	}
+	sha256_update(&ctx, page_data(offset), size);
+    }
+    sha256_final(&ctx, digest.sha256);
+    digest_valid = true;
+    return &digest;
+}
+
+/* The record page holds no journal, e.g. after a commit */
+static bool journal_is_blank(void)
+{
+    const uint32_t *word = (const uint32_t *) JOURNAL_ORIGIN;
+
+    while (word < (const uint32_t *) (IMAGE_RECORD_ORIGIN + FLASH_PAGE_SIZE)) {
+	if (*word++ != 0xFFFFFFFF) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * Open the progress journal of the fast-flash upload identified by key.
+ * If it is the journal of the update in progress, the upload resumes and
+ * 1 is returned. Otherwise a new journal is started, and 0 is returned.
+ * Journals are not kept while staging, the application area being only
+ * written on commit.
+ */
+int flash_engine_journal_open(uint32_t key)
+{
+    if (staging) {
+	return -1;
+    }
+    if (IMAGE_RECORD->magic == IMAGE_RECORD_INVALID && JOURNAL_KEY == key) {
+	journal_active = true;
+	image_dirty = true;
+	return 1;
+    }
+    if (slots_flush() < 0) {
+	return -1;
+    }
+    flash_unlock();
+
+    /* The record is invalidated in place first, as on the first write */
+    if (IMAGE_RECORD->magic != IMAGE_RECORD_INVALID) {
+	flash_program_word(IMAGE_RECORD_ORIGIN, IMAGE_RECORD_INVALID);
+    }
+
+    /* The journal of another upload is erased with the record page. The
+     * magic then reads as erased until it is invalidated again, so the
+     * reset vector of the uncommitted image is zeroed first: a reset in
+     * that window must not start a half-written image.
+     */
+    if (!journal_is_blank()) {
+	if (vectors_are_valid((const uint32_t *) MSC_FIRMWARE_ORIGIN)) {
+	    flash_program_word(MSC_FIRMWARE_ORIGIN + 4, 0);
+	    page_set_blank(0, (const uint8_t *) MSC_FIRMWARE_ORIGIN);
+	    digest_valid = false;
+	    image_length_valid = false;
+	}
+	flash_erase_page(IMAGE_RECORD_ORIGIN);
+	flash_program_word(IMAGE_RECORD_ORIGIN, IMAGE_RECORD_INVALID);
+    }
+    flash_program_word(JOURNAL_ORIGIN, key);
+    flash_lock();
+    journal_active = true;
+    image_dirty = true;
+    return flash_status() < 0 ? -1 : 0;
+}
+
+/* Get the CRC of a page listed in the open journal, the latest one wins */
+bool flash_engine_journal_page(uint32_t offset, uint32_t *crc)
+{
+    uint32_t tag = journal_tag(offset / FLASH_PAGE_SIZE);
+    bool found = false;
+    uint32_t i;
+
+    if (!journal_active) {
+	return false;
+    }
+    for (i = 0; i < JOURNAL_ENTRIES; i++) {
+	if (JOURNAL[i].page == tag) {
+	    *crc = JOURNAL[i].crc;
+	    found = true;
+	}
+    }
+    return found;
+}
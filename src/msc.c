@@ -0,0 +1,1314 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * Based on the libopencm3 usb_msc driver:
+ * Copyright (C) 2013 Weston Schmidt <weston_schmidt@alumni.purdue.edu>
+ * Copyright (C) 2013 Pavol Rusnak <stick@gk2.sk>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "msc.h"
+#include "buffer_pool.h"
+#include "trace.h"
+
+/* --- SCSI Commands ------------------------------------------------------- */
+
+/* For more details, see "SCSI Commands Reference Manual", Seagate,
+ * Rev. J, October 2016, and "Universal Serial Bus Mass Storage Class
+ * Bulk-Only Transport", Rev. 1.0, September 31, 1999.
+ */
+
+#define SCSI_TEST_UNIT_READY			0x00
+#define SCSI_REQUEST_SENSE			0x03
+#define SCSI_FORMAT_UNIT			0x04
+#define SCSI_READ_6				0x08
+#define SCSI_WRITE_6				0x0A
+#define SCSI_INQUIRY				0x12
+#define SCSI_MODE_SENSE_6			0x1A
+#define SCSI_START_STOP_UNIT			0x1B
+#define SCSI_SEND_DIAGNOSTIC			0x1D
+#define SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL	0x1E
+#define SCSI_READ_FORMAT_CAPACITIES		0x23
+#define SCSI_READ_CAPACITY_10			0x25
+#define SCSI_READ_10				0x28
+#define SCSI_WRITE_10				0x2A
+#define SCSI_VERIFY_10				0x2F
+#define SCSI_SYNCHRONIZE_CACHE_10		0x35
+#define SCSI_UNMAP				0x42
+#define SCSI_MODE_SENSE_10			0x5A
+#define SCSI_SERVICE_ACTION_IN_16		0x9E
+
+/* Vendor specific fast-flash commands, addressed in bytes from the start
+ * of the flash area (CDB bytes 2-5), with a length in bytes (CDB bytes
+ * 6-9):
+ *      FLASH WRITE: data out, block aligned offset and length,
+ *      FLASH ERASE: queue the whole pages of the range for erase,
+ *      FLASH CRC: data in, CRC-32 of the range (word aligned), 4 bytes,
+ *      FLASH INFO: data in, flash area size, erase unit and block size,
+ *              12 bytes,
+ *      REBOOT: restart once the status has been sent,
+ *      FLASH JOURNAL: data in, progress journal of the upload identified
+ *              by CDB bytes 2-5.
+ * All values are big-endian.
+ */
+#define SCSI_VENDOR_FLASH_WRITE			0xC0
+#define SCSI_VENDOR_FLASH_ERASE			0xC1
+#define SCSI_VENDOR_FLASH_CRC			0xC2
+#define SCSI_VENDOR_FLASH_INFO			0xC3
+#define SCSI_VENDOR_REBOOT			0xC4
+#define SCSI_VENDOR_FLASH_JOURNAL		0xC5
+
+/* Vendor specific buffer pool statistics, data in: buffer size (2 bytes),
+ * pool size, buffers in use, high-water mark, number of owners, failed
+ * allocations (2 bytes), then the buffers in use and high-water mark of
+ * each owner
+ */
+#define SCSI_VENDOR_BUFFER_STATS		0xC6
+
+/* Vendor specific write pipeline profile, data in, with USE_PIPELINE_PROFILE
+ * only: number of stages, then from byte 4 the bytes pushed into each
+ * stage and the CPU cycles spent in it (4 bytes each)
+ */
+#define SCSI_VENDOR_PIPELINE_STATS		0xC7
+
+/* SERVICE ACTION IN(16) service actions */
+#define SCSI_SA_READ_CAPACITY_16		0x10
+
+/* INQUIRY vital product data pages */
+#define SCSI_VPD_SUPPORTED_PAGES		0x00
+#define SCSI_VPD_BLOCK_LIMITS			0xB0
+#define SCSI_VPD_BLOCK_LIMITS_LENGTH		64
+#define SCSI_VPD_PROVISIONING			0xB2
+#define SCSI_VPD_PROVISIONING_LENGTH		8
+
+/* Logical Block Provisioning VPD page byte 5 UNMAP supported bit */
+#define SCSI_VPD_PROVISIONING_LBPU		0x80
+
+/* READ CAPACITY(16) byte 14 logical block provisioning management
+ * enabled bit
+ */
+#define SCSI_READ_CAPACITY_LBPME		0x80
+
+/* UNMAP parameter list header and block descriptor lengths */
+#define SCSI_UNMAP_HEADER_LENGTH		8
+#define SCSI_UNMAP_DESCRIPTOR_LENGTH		16
+
+/* Number of UNMAP block descriptors that fit in msd_buf */
+#define SCSI_UNMAP_MAX_DESCRIPTORS		((MSC_BLOCK_SIZE - \
+						  SCSI_UNMAP_HEADER_LENGTH) / \
+						 SCSI_UNMAP_DESCRIPTOR_LENGTH)
+
+/* WRITE(10) byte 1 Force Unit Access bit */
+#define SCSI_WRITE_FUA				0x08
+
+/* MODE SENSE byte 2 page control field and page codes */
+#define SCSI_MODE_PC_MASK			0xC0
+#define SCSI_MODE_PC_CHANGEABLE			0x40
+#define SCSI_MODE_PAGE_MASK			0x3F
+#define SCSI_MODE_PAGE_CACHING			0x08
+#define SCSI_MODE_PAGE_ALL			0x3F
+
+/* Mode parameter header device-specific parameter, DPO and FUA supported */
+#define SCSI_MODE_DPOFUA			0x10
+
+/* Caching mode page length and byte 2 Write Cache Enable bit */
+#define SCSI_MODE_CACHING_LENGTH		20
+#define SCSI_MODE_CACHING_WCE			0x04
+
+/* START STOP UNIT byte 4 bits */
+#define SCSI_START_STOP_START			0x01
+#define SCSI_START_STOP_LOEJ			0x02
+
+enum sbc_sense_key {
+	SBC_SENSE_KEY_NO_SENSE			= 0x00,
+	SBC_SENSE_KEY_NOT_READY			= 0x02,
+	SBC_SENSE_KEY_MEDIUM_ERROR		= 0x03,
+	SBC_SENSE_KEY_HARDWARE_ERROR		= 0x04,
+	SBC_SENSE_KEY_ILLEGAL_REQUEST		= 0x05,
+	SBC_SENSE_KEY_UNIT_ATTENTION		= 0x06,
+	SBC_SENSE_KEY_DATA_PROTECT		= 0x07,
+};
+
+enum sbc_asc {
+	SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION	= 0x00,
+	SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT	= 0x03,
+	SBC_ASC_UNRECOVERED_READ_ERROR		= 0x11,
+	SBC_ASC_INVALID_COMMAND_OPERATION_CODE	= 0x20,
+	SBC_ASC_LBA_OUT_OF_RANGE		= 0x21,
+	SBC_ASC_INVALID_FIELD_IN_CDB		= 0x24,
+	SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED	= 0x25,
+	SBC_ASC_NOT_READY_TO_READY_CHANGE	= 0x28,
+	SBC_ASC_MEDIUM_NOT_PRESENT		= 0x3A,
+	SBC_ASC_MEDIUM_REMOVAL_PREVENTED	= 0x53,
+};
+
+enum sbc_ascq {
+	SBC_ASCQ_NA				= 0x00,
+	SBC_ASCQ_MEDIUM_REMOVAL_PREVENTED	= 0x02,
+};
+
+/* --- Bulk-Only Transport ------------------------------------------------- */
+
+#define USB_MSC_CBW_DIRECTION_IN		0x80
+
+struct usb_msc_cbw {
+	uint32_t dCBWSignature;
+	uint32_t dCBWTag;
+	uint32_t dCBWDataTransferLength;
+	uint8_t  bmCBWFlags;
+	uint8_t  bCBWLUN;
+	uint8_t  bCBWCBLength;
+	uint8_t  CBWCB[16];
+} __attribute__((packed));
+
+struct usb_msc_csw {
+	uint32_t dCSWSignature;
+	uint32_t dCSWTag;
+	uint32_t dCSWDataResidue;
+	uint8_t  bCSWStatus;
+} __attribute__((packed));
+
+enum usb_msc_phase {
+	MSC_PHASE_CBW,
+	MSC_PHASE_DATA_IN,
+	MSC_PHASE_DATA_OUT,
+	MSC_PHASE_CSW,
+
+	/* An invalid CBW has been received, both bulk endpoints are stalled
+	 * until the host performs a Reset Recovery
+	 */
+	MSC_PHASE_RESET,
+};
+
+struct sbc_sense_info {
+	uint8_t key;
+	uint8_t asc;
+	uint8_t ascq;
+};
+
+struct usb_msc_trans {
+	enum usb_msc_phase phase;
+	uint8_t cbw_count;
+	struct usb_msc_cbw cbw;
+
+	/* Bytes moved during the data stage, the part of them carrying
+	 * actual data (the rest is zero padding, or discarded), and the
+	 * count of bytes moved so far.
+	 */
+	uint32_t data_length;
+	uint32_t data_valid;
+	uint32_t data_count;
+
+	/* Data stage goes through read_block() or the write pipeline, or
+	 * the flash write() for a FLASH WRITE
+	 */
+	bool block_transfer;
+	bool flash_transfer;
+	uint32_t lba;
+
+	/* Called at the end of a data out stage that is not a block
+	 * transfer, with the parameter data in msd_buf.
+	 */
+	void (*complete)(usbd_mass_storage *ms);
+
+	/* Called once the status of the current command has been queued,
+	 * for a medium eject or a reboot
+	 */
+	void (*status_sent)(void);
+
+	/* Flush the written blocks before returning the status */
+	bool fua;
+
+	/* Transfer buffer, taken from the buffer pool */
+	uint8_t *msd_buf;
+
+	/* Buffer the current written block is received into: msd_buf, or
+	 * one lent by the write pipeline so that the block is not copied
+	 */
+	uint8_t *block_buf;
+	struct usb_msc_csw csw;
+};
+
+struct _usbd_mass_storage {
+	usbd_device *usbd_dev;
+	uint8_t ep_in;
+	uint8_t ep_in_size;
+	uint8_t ep_out;
+	uint8_t ep_out_size;
+
+	const char *vendor_id;
+	const char *product_id;
+	const char *product_revision_level;
+
+	/* Logical units, and the one addressed by the current command */
+	const struct msc_lun *luns;
+	uint8_t lun_count;
+	const struct msc_lun *lun;
+
+	struct sbc_sense_info sense;
+
+	/* Bitmaps of the logical units whose medium removal is prevented,
+	 * and whose medium has changed since their last command
+	 */
+	uint8_t prevent_removal;
+	uint8_t unit_attention;
+
+	struct usb_msc_trans trans;
+};
+
+static usbd_mass_storage _mass_storage;
+
+/* Source of padding, and sink of discarded data */
+static const uint8_t zero_packet[64];
+static uint8_t discard_packet[64];
+
+/* --- Helpers ------------------------------------------------------------- */
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/* Copy a string into a fixed-size, space padded INQUIRY field */
+static void put_padded(uint8_t *p, const char *s, size_t size)
+{
+	size_t length = strlen(s);
+
+	memset(p, ' ', size);
+	memcpy(p, s, length < size ? length : size);
+}
+
+static void set_sbc_status(usbd_mass_storage *ms,
+			   enum sbc_sense_key key,
+			   enum sbc_asc asc,
+			   enum sbc_ascq ascq)
+{
+	ms->sense.key = (uint8_t) key;
+	ms->sense.asc = (uint8_t) asc;
+	ms->sense.ascq = (uint8_t) ascq;
+}
+
+static void set_sbc_status_good(usbd_mass_storage *ms)
+{
+	set_sbc_status(ms,
+		       SBC_SENSE_KEY_NO_SENSE,
+		       SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION,
+		       SBC_ASCQ_NA);
+}
+
+/*
+ * Fail the current command. The rest of the data stage is still carried
+ * out, zero padded towards the host or discarded from it, so that the
+ * endpoints never need to be stalled.
+ */
+static void scsi_fail(usbd_mass_storage *ms,
+		      enum sbc_sense_key key,
+		      enum sbc_asc asc,
+		      enum sbc_ascq ascq)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+
+	set_sbc_status(ms, key, asc, ascq);
+	trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
+	trans->block_transfer = false;
+	trans->flash_transfer = false;
+	trans->complete = NULL;
+	trans->status_sent = NULL;
+	trans->fua = false;
+	if (trans->data_valid > trans->data_count) {
+		trans->data_valid = trans->data_count;
+	}
+}
+
+/* Return a response of length bytes prepared in msd_buf */
+static void scsi_data_in(struct usb_msc_trans *trans, uint32_t length)
+{
+	trans->data_valid = length;
+}
+
+/* --- SCSI Command Handlers ----------------------------------------------- */
+
+static void scsi_read_write(usbd_mass_storage *ms,
+			    struct usb_msc_trans *trans,
+			    uint32_t lba, uint32_t count)
+{
+	if (lba >= ms->lun->block_count ||
+	    count > ms->lun->block_count - lba) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_LBA_OUT_OF_RANGE, SBC_ASCQ_NA);
+		return;
+	}
+	trans->block_transfer = true;
+	trans->lba = lba;
+	trans->data_valid = count * MSC_BLOCK_SIZE;
+}
+
+static void scsi_request_sense(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans)
+{
+	uint8_t *buf = trans->msd_buf;
+
+	/* Fixed format sense data */
+	buf[0] = 0x70;
+	buf[2] = ms->sense.key;
+	buf[7] = 10;
+	buf[12] = ms->sense.asc;
+	buf[13] = ms->sense.ascq;
+	scsi_data_in(trans, 18);
+	set_sbc_status_good(ms);
+}
+
+static void scsi_inquiry_vpd(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans)
+{
+	uint8_t *buf = trans->msd_buf;
+
+	buf[1] = trans->cbw.CBWCB[2];
+	switch (buf[1]) {
+	case SCSI_VPD_SUPPORTED_PAGES:
+		buf[3] = 2;
+		buf[4] = SCSI_VPD_SUPPORTED_PAGES;
+		buf[5] = SCSI_VPD_BLOCK_LIMITS;
+		if (ms->lun->unmap != NULL) {
+			buf[6] = SCSI_VPD_PROVISIONING;
+			buf[3]++;
+		}
+		scsi_data_in(trans, 4 + buf[3]);
+		break;
+
+	case SCSI_VPD_BLOCK_LIMITS:
+
+		/* Transfers sized and aligned on the logical unit erase
+		 * unit, ideally what its write-back cache holds. There is
+		 * no maximum transfer length (0), which hosts would also
+		 * apply to reads.
+		 */
+		buf[3] = SCSI_VPD_BLOCK_LIMITS_LENGTH - 4;
+		buf[6] = ms->lun->granularity >> 8;
+		buf[7] = ms->lun->granularity;
+		put_be32(buf + 12, ms->lun->optimal_transfer);
+		if (ms->lun->unmap != NULL) {
+
+			/* Maximum unmap LBA and block descriptor counts,
+			 * optimal unmap granularity, and its alignment
+			 * (valid, 0)
+			 */
+			put_be32(buf + 20, ms->lun->block_count);
+			put_be32(buf + 24, SCSI_UNMAP_MAX_DESCRIPTORS);
+			put_be32(buf + 28, ms->lun->granularity);
+			buf[32] = 0x80;
+		}
+		scsi_data_in(trans, SCSI_VPD_BLOCK_LIMITS_LENGTH);
+		break;
+
+	case SCSI_VPD_PROVISIONING:
+		if (ms->lun->unmap == NULL) {
+			scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+				  SBC_ASC_INVALID_FIELD_IN_CDB, SBC_ASCQ_NA);
+			break;
+		}
+		buf[3] = SCSI_VPD_PROVISIONING_LENGTH - 4;
+		buf[5] = SCSI_VPD_PROVISIONING_LBPU;
+		scsi_data_in(trans, SCSI_VPD_PROVISIONING_LENGTH);
+		break;
+
+	default:
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_FIELD_IN_CDB, SBC_ASCQ_NA);
+		break;
+	}
+}
+
+static void scsi_inquiry(usbd_mass_storage *ms,
+			 struct usb_msc_trans *trans)
+{
+	uint8_t *buf = trans->msd_buf;
+
+	if (trans->cbw.CBWCB[1] & 0x01) {
+		scsi_inquiry_vpd(ms, trans);
+		return;
+	}
+	buf[0] = 0x00;		/* Direct access block device */
+	buf[1] = 0x80;		/* Removable medium */
+	buf[2] = 0x05;		/* SPC-3 */
+	buf[3] = 0x02;		/* Response data format */
+	buf[4] = 36 - 5;	/* Additional length */
+	put_padded(buf + 8, ms->vendor_id, 8);
+	put_padded(buf + 16, ms->product_id, 16);
+	put_padded(buf + 32, ms->product_revision_level, 4);
+	scsi_data_in(trans, 36);
+}
+
+/*
+ * Append the requested mode pages to a mode parameter header, returns
+ * their length. Only the caching page is reported, with the write cache
+ * enabled when the logical unit has to be flushed.
+ */
+static uint32_t scsi_mode_pages(usbd_mass_storage *ms,
+				struct usb_msc_trans *trans, uint8_t *p)
+{
+	uint8_t control = trans->cbw.CBWCB[2] & SCSI_MODE_PC_MASK;
+	uint8_t page = trans->cbw.CBWCB[2] & SCSI_MODE_PAGE_MASK;
+
+	if (page != SCSI_MODE_PAGE_CACHING && page != SCSI_MODE_PAGE_ALL) {
+		return 0;
+	}
+	p[0] = SCSI_MODE_PAGE_CACHING;
+	p[1] = SCSI_MODE_CACHING_LENGTH - 2;
+
+	/* The write cache setting is not changeable */
+	if (control != SCSI_MODE_PC_CHANGEABLE && ms->lun->flush != NULL) {
+		p[2] = SCSI_MODE_CACHING_WCE;
+	}
+	return SCSI_MODE_CACHING_LENGTH;
+}
+
+static void scsi_mode_sense_6(usbd_mass_storage *ms,
+			      struct usb_msc_trans *trans)
+{
+	uint32_t length = 4;
+
+	/* Mode parameter header, no block descriptor */
+	trans->msd_buf[2] = SCSI_MODE_DPOFUA;
+	length += scsi_mode_pages(ms, trans, trans->msd_buf + length);
+	trans->msd_buf[0] = length - 1;
+	scsi_data_in(trans, length);
+}
+
+static void scsi_mode_sense_10(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans)
+{
+	uint32_t length = 8;
+
+	trans->msd_buf[3] = SCSI_MODE_DPOFUA;
+	length += scsi_mode_pages(ms, trans, trans->msd_buf + length);
+	trans->msd_buf[1] = length - 2;
+	scsi_data_in(trans, length);
+}
+
+static void scsi_start_stop_unit(usbd_mass_storage *ms,
+				 struct usb_msc_trans *trans)
+{
+	uint8_t flags = trans->cbw.CBWCB[4];
+
+	if ((flags & (SCSI_START_STOP_LOEJ | SCSI_START_STOP_START)) !=
+	    SCSI_START_STOP_LOEJ) {
+		return;
+	}
+	if (ms->prevent_removal & (1 << trans->cbw.bCBWLUN)) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_MEDIUM_REMOVAL_PREVENTED,
+			  SBC_ASCQ_MEDIUM_REMOVAL_PREVENTED);
+		return;
+	}
+	trans->status_sent = ms->lun->eject;
+}
+
+static void scsi_prevent_allow_medium_removal(usbd_mass_storage *ms,
+					      struct usb_msc_trans *trans)
+{
+	uint8_t mask = 1 << trans->cbw.bCBWLUN;
+
+	if (trans->cbw.CBWCB[4] & 0x01) {
+		ms->prevent_removal |= mask;
+	} else {
+		ms->prevent_removal &= ~mask;
+	}
+}
+
+static void scsi_read_format_capacities(usbd_mass_storage *ms,
+					struct usb_msc_trans *trans)
+{
+	uint8_t *buf = trans->msd_buf;
+
+	buf[3] = 8;		/* Capacity list length */
+	put_be32(buf + 4, ms->lun->block_count);
+
+	/* Formatted media, and block length */
+	put_be32(buf + 8, (0x02 << 24) | MSC_BLOCK_SIZE);
+	scsi_data_in(trans, 12);
+}
+
+static void scsi_read_capacity(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans)
+{
+	put_be32(trans->msd_buf, ms->lun->block_count - 1);
+	put_be32(trans->msd_buf + 4, MSC_BLOCK_SIZE);
+	scsi_data_in(trans, 8);
+}
+
+static void scsi_read_capacity_16(usbd_mass_storage *ms,
+				  struct usb_msc_trans *trans)
+{
+	uint8_t *buf = trans->msd_buf;
+	uint16_t exponent = 0;
+
+	if ((trans->cbw.CBWCB[1] & 0x1F) != SCSI_SA_READ_CAPACITY_16) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	put_be32(buf + 4, ms->lun->block_count - 1);
+	put_be32(buf + 8, MSC_BLOCK_SIZE);
+
+	/* The erase unit is reported as the physical block */
+	while ((2 << exponent) <= ms->lun->granularity) {
+		exponent++;
+	}
+	buf[13] = exponent;
+	if (ms->lun->unmap != NULL) {
+		buf[14] = SCSI_READ_CAPACITY_LBPME;
+	}
+	scsi_data_in(trans, 32);
+}
+
+static void scsi_unmap_complete(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	const uint8_t *p = trans->msd_buf + SCSI_UNMAP_HEADER_LENGTH;
+	uint32_t length = get_be16(trans->msd_buf + 2);
+
+	if (trans->data_valid < SCSI_UNMAP_HEADER_LENGTH) {
+		return;
+	}
+	if (length > trans->data_valid - SCSI_UNMAP_HEADER_LENGTH) {
+		length = trans->data_valid - SCSI_UNMAP_HEADER_LENGTH;
+	}
+	for (; length >= SCSI_UNMAP_DESCRIPTOR_LENGTH;
+	     length -= SCSI_UNMAP_DESCRIPTOR_LENGTH,
+		     p += SCSI_UNMAP_DESCRIPTOR_LENGTH) {
+		uint32_t lba = get_be32(p + 4);
+		uint32_t count = get_be32(p + 8);
+
+		if (get_be32(p) != 0 || lba > ms->lun->block_count ||
+		    count > ms->lun->block_count - lba) {
+			scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+				  SBC_ASC_LBA_OUT_OF_RANGE, SBC_ASCQ_NA);
+			return;
+		}
+		if (count > 0 && ms->lun->unmap(lba, count) != 0) {
+			scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				  SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				  SBC_ASCQ_NA);
+			return;
+		}
+	}
+}
+
+static void scsi_unmap(usbd_mass_storage *ms,
+		       struct usb_msc_trans *trans)
+{
+	uint32_t length = get_be16(trans->cbw.CBWCB + 7);
+
+	if (ms->lun->unmap == NULL) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	if (length < SCSI_UNMAP_HEADER_LENGTH) {
+		return;
+	}
+	trans->data_valid = length < MSC_BLOCK_SIZE ? length : MSC_BLOCK_SIZE;
+	trans->complete = scsi_unmap_complete;
+}
+
+static void scsi_synchronize_cache(usbd_mass_storage *ms,
+				   struct usb_msc_trans *trans)
+{
+	(void) trans;
+
+	if (ms->lun->flush != NULL && ms->lun->flush() != 0) {
+		scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+			  SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+			  SBC_ASCQ_NA);
+	}
+}
+
+/* --- Vendor Specific Fast-Flash Commands --------------------------------- */
+
+/* Check the range of a fast-flash command, returns false if it failed */
+static bool scsi_flash_range(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans,
+			     uint32_t *offset, uint32_t *length,
+			     uint32_t alignment)
+{
+	const struct msc_flash *flash = ms->lun->flash;
+
+	if (flash == NULL) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return false;
+	}
+	*offset = get_be32(trans->cbw.CBWCB + 2);
+	*length = get_be32(trans->cbw.CBWCB + 6);
+	if (*offset > flash->size || *length > flash->size - *offset) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_LBA_OUT_OF_RANGE, SBC_ASCQ_NA);
+		return false;
+	}
+	if ((*offset | *length) & (alignment - 1)) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_FIELD_IN_CDB, SBC_ASCQ_NA);
+		return false;
+	}
+	return true;
+}
+
+static void scsi_flash_write(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans)
+{
+	uint32_t offset, length;
+
+	if (scsi_flash_range(ms, trans, &offset, &length, MSC_BLOCK_SIZE)) {
+		trans->block_transfer = true;
+		trans->flash_transfer = true;
+		trans->lba = offset / MSC_BLOCK_SIZE;
+		trans->data_valid = length;
+	}
+}
+
+static void scsi_flash_erase(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans)
+{
+	uint32_t offset, length;
+
+	if (scsi_flash_range(ms, trans, &offset, &length, 1) &&
+	    ms->lun->flash->erase(offset, length) != 0) {
+		scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+			  SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+			  SBC_ASCQ_NA);
+	}
+}
+
+static void scsi_flash_crc(usbd_mass_storage *ms,
+			   struct usb_msc_trans *trans)
+{
+	uint32_t offset, length;
+
+	if (scsi_flash_range(ms, trans, &offset, &length, 4)) {
+		put_be32(trans->msd_buf, ms->lun->flash->crc(offset, length));
+		scsi_data_in(trans, 4);
+	}
+}
+
+static void scsi_flash_info(usbd_mass_storage *ms,
+			    struct usb_msc_trans *trans)
+{
+	const struct msc_flash *flash = ms->lun->flash;
+
+	if (flash == NULL) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	put_be32(trans->msd_buf, flash->size);
+	put_be32(trans->msd_buf + 4, flash->erase_size);
+	put_be32(trans->msd_buf + 8, MSC_BLOCK_SIZE);
+	scsi_data_in(trans, 12);
+}
+
+/*
+ * Open the progress journal of an upload, and return the CRCs of the erase
+ * units programmed since it was started: the key, a resume flag, the erase
+ * unit size and count, a bitmap of the listed units, then their CRCs.
+ */
+static void scsi_flash_journal(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans)
+{
+	const struct msc_flash *flash = ms->lun->flash;
+	uint8_t *buf = trans->msd_buf;
+	uint32_t key = get_be32(trans->cbw.CBWCB + 2);
+	uint32_t units, length, unit, crc;
+	uint8_t *crcs;
+	int status;
+
+	if (flash == NULL || flash->journal_open == NULL) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	units = flash->size / flash->erase_size;
+	crcs = buf + 16 + (units + 31) / 32 * 4;
+	length = crcs + units * 4 - buf;
+	if (length > MSC_BLOCK_SIZE) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_FIELD_IN_CDB, SBC_ASCQ_NA);
+		return;
+	}
+	status = flash->journal_open(key);
+	if (status < 0) {
+		scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+			  SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	put_be32(buf, key);
+	buf[4] = status;
+	put_be32(buf + 8, flash->erase_size);
+	put_be32(buf + 12, units);
+	for (unit = 0; unit < units; unit++) {
+		if (flash->journal_page(unit * flash->erase_size, &crc)) {
+			buf[16 + unit / 8] |= 1 << (unit % 8);
+			put_be32(crcs + unit * 4, crc);
+		}
+	}
+	scsi_data_in(trans, length);
+}
+
+static void scsi_buffer_stats(struct usb_msc_trans *trans)
+{
+	const struct buffer_pool_stats *stats = buffer_pool_stats();
+	uint8_t *buf = trans->msd_buf;
+	int i;
+
+	buf[0] = BUFFER_SIZE >> 8;
+	buf[1] = BUFFER_SIZE & 0xFF;
+	buf[2] = BUFFER_POOL_COUNT;
+	buf[3] = stats->in_use;
+	buf[4] = stats->high_water;
+	buf[5] = BUFFER_OWNERS;
+	buf[6] = stats->failures >> 8;
+	buf[7] = stats->failures & 0xFF;
+	for (i = 0; i < BUFFER_OWNERS; i++) {
+		buf[8 + i * 2] = stats->owned[i];
+		buf[9 + i * 2] = stats->owned_high_water[i];
+	}
+	scsi_data_in(trans, 8 + BUFFER_OWNERS * 2);
+}
+
+#ifdef USE_PIPELINE_PROFILE
+static void scsi_pipeline_stats(struct usb_msc_trans *trans)
+{
+	const struct pipeline_profile *profile = pipeline_profile();
+	uint8_t *buf = trans->msd_buf;
+	int i;
+
+	buf[0] = PIPELINE_STAGES;
+	for (i = 0; i < PIPELINE_STAGES; i++) {
+		put_be32(buf + 4 + i * 8, profile[i].bytes);
+		put_be32(buf + 8 + i * 8, profile[i].cycles);
+	}
+	scsi_data_in(trans, 4 + PIPELINE_STAGES * 8);
+}
+#endif
+
+static void scsi_reboot(usbd_mass_storage *ms,
+			struct usb_msc_trans *trans)
+{
+	if (ms->lun->flash == NULL) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		return;
+	}
+	trans->status_sent = ms->lun->flash->reboot;
+}
+
+static void scsi_command(usbd_mass_storage *ms,
+			 struct usb_msc_trans *trans)
+{
+	const uint8_t *cb = trans->cbw.CBWCB;
+	uint8_t mask = 1 << trans->cbw.bCBWLUN;
+	uint32_t count;
+
+	if (trans->cbw.bCBWLUN >= ms->lun_count) {
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED, SBC_ASCQ_NA);
+		return;
+	}
+	ms->lun = &ms->luns[trans->cbw.bCBWLUN];
+
+	/* Report a medium change once, to any command but the two that
+	 * must not clear it. This makes the host drop its cached sectors.
+	 */
+	if (ms->unit_attention & mask) {
+		set_sbc_status(ms, SBC_SENSE_KEY_UNIT_ATTENTION,
+			       SBC_ASC_NOT_READY_TO_READY_CHANGE,
+			       SBC_ASCQ_NA);
+		if (cb[0] != SCSI_INQUIRY) {
+			ms->unit_attention &= ~mask;
+			if (cb[0] != SCSI_REQUEST_SENSE) {
+				scsi_fail(ms, SBC_SENSE_KEY_UNIT_ATTENTION,
+					  SBC_ASC_NOT_READY_TO_READY_CHANGE,
+					  SBC_ASCQ_NA);
+				return;
+			}
+		}
+	}
+
+	switch (cb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_FORMAT_UNIT:
+	case SCSI_SEND_DIAGNOSTIC:
+	case SCSI_VERIFY_10:
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		scsi_request_sense(ms, trans);
+		break;
+
+	case SCSI_READ_6:
+	case SCSI_WRITE_6:
+		count = cb[4] ? cb[4] : 256;
+		scsi_read_write(ms, trans,
+				get_be32(cb) & 0x1FFFFF, count);
+		break;
+
+	case SCSI_INQUIRY:
+		scsi_inquiry(ms, trans);
+		break;
+
+	case SCSI_MODE_SENSE_6:
+		scsi_mode_sense_6(ms, trans);
+		break;
+
+	case SCSI_MODE_SENSE_10:
+		scsi_mode_sense_10(ms, trans);
+		break;
+
+	case SCSI_START_STOP_UNIT:
+		scsi_start_stop_unit(ms, trans);
+		break;
+
+	case SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL:
+		scsi_prevent_allow_medium_removal(ms, trans);
+		break;
+
+	case SCSI_READ_FORMAT_CAPACITIES:
+		scsi_read_format_capacities(ms, trans);
+		break;
+
+	case SCSI_READ_CAPACITY_10:
+		scsi_read_capacity(ms, trans);
+		break;
+
+	case SCSI_WRITE_10:
+		trans->fua = (cb[1] & SCSI_WRITE_FUA) != 0;
+
+		/* Fall through */
+	case SCSI_READ_10:
+		scsi_read_write(ms, trans, get_be32(cb + 2),
+				get_be16(cb + 7));
+		break;
+
+	case SCSI_SYNCHRONIZE_CACHE_10:
+		scsi_synchronize_cache(ms, trans);
+		break;
+
+	case SCSI_UNMAP:
+		scsi_unmap(ms, trans);
+		break;
+
+	case SCSI_SERVICE_ACTION_IN_16:
+		scsi_read_capacity_16(ms, trans);
+		break;
+
+	case SCSI_VENDOR_FLASH_WRITE:
+		scsi_flash_write(ms, trans);
+		break;
+
+	case SCSI_VENDOR_FLASH_ERASE:
+		scsi_flash_erase(ms, trans);
+		break;
+
+	case SCSI_VENDOR_FLASH_CRC:
+		scsi_flash_crc(ms, trans);
+		break;
+
+	case SCSI_VENDOR_FLASH_INFO:
+		scsi_flash_info(ms, trans);
+		break;
+
+	case SCSI_VENDOR_REBOOT:
+		scsi_reboot(ms, trans);
+		break;
+
+	case SCSI_VENDOR_FLASH_JOURNAL:
+		scsi_flash_journal(ms, trans);
+		break;
+
+	case SCSI_VENDOR_BUFFER_STATS:
+		scsi_buffer_stats(trans);
+		break;
+
+#ifdef USE_PIPELINE_PROFILE
+	case SCSI_VENDOR_PIPELINE_STATS:
+		scsi_pipeline_stats(trans);
+		break;
+#endif
+
+	default:
+		scsi_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			  SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+			  SBC_ASCQ_NA);
+		break;
+	}
+}
+
+/* --- Bulk-Only Transport State Machine ----------------------------------- */
+
+static void msc_send_csw(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t expected = trans->cbw.dCBWDataTransferLength;
+
+	trans->phase = MSC_PHASE_CSW;
+	trans->csw.dCSWSignature = USB_MSC_CSW_SIGNATURE;
+	trans->csw.dCSWTag = trans->cbw.dCBWTag;
+	trans->csw.dCSWDataResidue = expected -
+		(trans->data_valid < expected ? trans->data_valid : expected);
+
+	/* The endpoint may still hold the previous CSW, in which case the
+	 * transmit callback will try again.
+	 */
+	if (usbd_ep_write_packet(ms->usbd_dev, ms->ep_in, &trans->csw,
+				 sizeof (trans->csw)) != sizeof (trans->csw)) {
+		return;
+	}
+	TRACE(TRACE_CSW, trans->csw.bCSWStatus, trans->csw.dCSWTag,
+	      trans->csw.dCSWDataResidue);
+	trans->phase = MSC_PHASE_CBW;
+	if (trans->status_sent != NULL) {
+		void (*status_sent)(void) = trans->status_sent;
+
+		trans->status_sent = NULL;
+		status_sent();
+	}
+}
+
+static void msc_send_data_in(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t offset = trans->data_count % MSC_BLOCK_SIZE;
+	uint32_t length = trans->data_length - trans->data_count;
+	const uint8_t *p = zero_packet;
+
+	if (length > ms->ep_in_size) {
+		length = ms->ep_in_size;
+	}
+	if (trans->data_count < trans->data_valid) {
+		int status = 0;
+
+		/* The host is NAKed while the block is read */
+		if (trans->block_transfer && offset == 0) {
+			TRACE(TRACE_NAK_BEGIN, ms->ep_in, trans->lba, 0);
+			status = ms->lun->read_block(trans->lba,
+						     trans->msd_buf);
+			TRACE(TRACE_NAK_END, ms->ep_in, trans->lba, 0);
+		}
+		if (!trans->block_transfer) {
+			p = trans->msd_buf + trans->data_count;
+		} else if (status == 0) {
+			if (offset + length == MSC_BLOCK_SIZE) {
+				trans->lba++;
+			}
+			p = trans->msd_buf + offset;
+		} else {
+			scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				  SBC_ASC_UNRECOVERED_READ_ERROR,
+				  SBC_ASCQ_NA);
+		}
+	}
+	if (usbd_ep_write_packet(ms->usbd_dev, ms->ep_in, p, length) ==
+	    length) {
+		TRACE(TRACE_USB_IN, ms->ep_in, length, 0);
+		trans->data_count += length;
+	}
+}
+
+static int msc_write_block(usbd_mass_storage *ms,
+			   struct usb_msc_trans *trans)
+{
+	if (trans->flash_transfer) {
+		return ms->lun->flash->write(trans->lba * MSC_BLOCK_SIZE,
+					     trans->msd_buf);
+	}
+	return pipeline_push(ms->lun->write_pipeline,
+			     trans->lba * MSC_BLOCK_SIZE, trans->block_buf,
+			     MSC_BLOCK_SIZE);
+}
+
+static void msc_receive_data_out(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t offset = trans->data_count % MSC_BLOCK_SIZE;
+	uint8_t *p = discard_packet;
+	uint16_t length;
+
+	if (trans->data_count < trans->data_valid &&
+	    (trans->block_transfer || trans->data_count < MSC_BLOCK_SIZE)) {
+		if (offset == 0) {
+			trans->block_buf = NULL;
+			if (trans->block_transfer && !trans->flash_transfer) {
+				trans->block_buf = pipeline_claim(
+					ms->lun->write_pipeline,
+					trans->lba * MSC_BLOCK_SIZE);
+			}
+			if (trans->block_buf == NULL) {
+				trans->block_buf = trans->msd_buf;
+			}
+		}
+		p = trans->block_buf + offset;
+	}
+	pipeline_profile_begin();
+	length = usbd_ep_read_packet(ms->usbd_dev, ms->ep_out, p,
+				     ms->ep_out_size);
+	pipeline_profile_end(PIPELINE_RECEIVE, length);
+	TRACE(TRACE_USB_OUT, ms->ep_out, length, 0);
+	trans->data_count += length;
+	if (trans->block_transfer &&
+	    trans->data_count <= trans->data_valid &&
+	    (trans->data_count % MSC_BLOCK_SIZE) == 0) {
+		int status;
+
+		/* The host is NAKed while the block is written */
+		TRACE(TRACE_NAK_BEGIN, ms->ep_out, trans->lba, 0);
+		status = msc_write_block(ms, trans);
+		TRACE(TRACE_NAK_END, ms->ep_out, trans->lba, 0);
+		if (status != 0) {
+			scsi_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				  SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				  SBC_ASCQ_NA);
+			trans->data_valid = trans->data_count - MSC_BLOCK_SIZE;
+		}
+		trans->lba++;
+	}
+	if (trans->data_count >= trans->data_length) {
+		if (trans->complete != NULL) {
+			trans->complete(ms);
+		}
+		if (trans->fua && ms->lun->flush != NULL) {
+			scsi_synchronize_cache(ms, trans);
+		}
+		msc_send_csw(ms);
+	}
+}
+
+static void msc_receive_cbw(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t expected;
+
+	trans->cbw_count += usbd_ep_read_packet(ms->usbd_dev, ms->ep_out,
+						(uint8_t *) &trans->cbw +
+						trans->cbw_count,
+						sizeof (trans->cbw) -
+						trans->cbw_count);
+	if (trans->cbw_count < sizeof (trans->cbw)) {
+		return;
+	}
+	trans->cbw_count = 0;
+	if (trans->cbw.dCBWSignature != USB_MSC_CBW_SIGNATURE) {
+		usbd_ep_stall_set(ms->usbd_dev, ms->ep_in, 1);
+		usbd_ep_stall_set(ms->usbd_dev, ms->ep_out, 1);
+		trans->phase = MSC_PHASE_RESET;
+		return;
+	}
+
+	expected = trans->cbw.dCBWDataTransferLength;
+	TRACE(TRACE_CBW, trans->cbw.bCBWLUN, trans->cbw.dCBWTag, expected);
+	TRACE(TRACE_SCSI, trans->cbw.CBWCB[0], get_be32(trans->cbw.CBWCB + 2),
+	      get_be16(trans->cbw.CBWCB + 7));
+	trans->data_valid = 0;
+	trans->data_count = 0;
+	trans->block_transfer = false;
+	trans->flash_transfer = false;
+	trans->complete = NULL;
+	trans->status_sent = NULL;
+	trans->fua = false;
+	trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_SUCCESS;
+	memset(trans->msd_buf, 0, MSC_BLOCK_SIZE);
+
+	scsi_command(ms, trans);
+
+	if (trans->data_valid > expected) {
+		trans->data_valid = expected;
+	}
+	if (expected == 0) {
+		msc_send_csw(ms);
+	} else if (trans->cbw.bmCBWFlags & USB_MSC_CBW_DIRECTION_IN) {
+
+		/* A short response ends with a short packet, unless it is
+		 * a multiple of the packet size, in which case it is padded
+		 * up to what the host expects.
+		 */
+		trans->data_length = trans->data_valid;
+		if (trans->data_length % ms->ep_in_size == 0) {
+			trans->data_length = expected;
+		}
+		trans->phase = MSC_PHASE_DATA_IN;
+		msc_send_data_in(ms);
+	} else {
+		trans->data_length = expected;
+		trans->phase = MSC_PHASE_DATA_OUT;
+	}
+}
+
+static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void) ep;
+
+	switch (ms->trans.phase) {
+	case MSC_PHASE_CBW:
+		msc_receive_cbw(ms);
+		break;
+
+	case MSC_PHASE_DATA_OUT:
+		msc_receive_data_out(ms);
+		break;
+
+	default:
+
+		/* Unexpected packet, drop it */
+		usbd_ep_read_packet(usbd_dev, ms->ep_out, discard_packet,
+				    sizeof (discard_packet));
+		break;
+	}
+}
+
+static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void) usbd_dev;
+	(void) ep;
+
+	switch (ms->trans.phase) {
+	case MSC_PHASE_DATA_IN:
+		if (ms->trans.data_count < ms->trans.data_length) {
+			msc_send_data_in(ms);
+		} else {
+			msc_send_csw(ms);
+		}
+		break;
+
+	case MSC_PHASE_CSW:
+		msc_send_csw(ms);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static enum usbd_request_return_codes
+msc_control_request(usbd_device *usbd_dev,
+		    struct usb_setup_data *req, uint8_t **buf,
+		    uint16_t *len,
+		    usbd_control_complete_callback *complete)
+{
+	(void) usbd_dev;
+	(void) complete;
+
+	switch (req->bRequest) {
+	case USB_MSC_REQ_BULK_ONLY_RESET:
+		_mass_storage.trans.phase = MSC_PHASE_CBW;
+		_mass_storage.trans.cbw_count = 0;
+		return USBD_REQ_HANDLED;
+
+	case USB_MSC_REQ_GET_MAX_LUN:
+		(*buf)[0] = _mass_storage.lun_count - 1;
+		*len = 1;
+		return USBD_REQ_HANDLED;
+	}
+	return USBD_REQ_NOTSUPP;
+}
+
+static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void) wValue;
+
+	usbd_ep_setup(usbd_dev, ms->ep_in, USB_ENDPOINT_ATTR_BULK,
+		      ms->ep_in_size, msc_data_tx_cb);
+	usbd_ep_setup(usbd_dev, ms->ep_out, USB_ENDPOINT_ATTR_BULK,
+		      ms->ep_out_size, msc_data_rx_cb);
+	usbd_register_control_callback(usbd_dev,
+				       USB_REQ_TYPE_CLASS |
+				       USB_REQ_TYPE_INTERFACE,
+				       USB_REQ_TYPE_TYPE |
+				       USB_REQ_TYPE_RECIPIENT,
+				       msc_control_request);
+}
+
+/*
+ * Signal that the medium contents of a logical unit have changed behind the
+ * host's back: the next command to it fails with a UNIT ATTENTION, MEDIUM
+ * MAY HAVE CHANGED condition.
+ */
+void msc_medium_changed(usbd_mass_storage *ms, uint8_t lun)
+{
+	ms->unit_attention |= 1 << lun;
+}
+
+/* Logical units are numbered from 0 in the luns array, up to 8 of them */
+usbd_mass_storage *msc_init(usbd_device *usbd_dev,
+			    uint8_t ep_in, uint8_t ep_in_size,
+			    uint8_t ep_out, uint8_t ep_out_size,
+			    const char *vendor_id,
+			    const char *product_id,
+			    const char *product_revision_level,
+			    const struct msc_lun *luns, uint8_t lun_count)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	ms->usbd_dev = usbd_dev;
+	ms->ep_in = ep_in;
+	ms->ep_in_size = ep_in_size;
+	ms->ep_out = ep_out;
+	ms->ep_out_size = ep_out_size;
+	ms->vendor_id = vendor_id;
+	ms->product_id = product_id;
+	ms->product_revision_level = product_revision_level;
+	ms->luns = luns;
+	ms->lun_count = lun_count;
+	ms->lun = &luns[0];
+	ms->trans.msd_buf = buffer_alloc(MSC_BLOCK_SIZE / BUFFER_SIZE,
+					 BUFFER_USB);
+	if (ms->trans.msd_buf == NULL) {
+		return NULL;
+	}
+	ms->trans.phase = MSC_PHASE_CBW;
+	set_sbc_status_good(ms);
+
+	usbd_register_set_config_callback(usbd_dev, msc_set_config);
+
+	return ms;
+}
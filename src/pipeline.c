@@ -0,0 +1,83 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#ifdef USE_PIPELINE_PROFILE
+
+#include <stdbool.h>
+#include <libopencm3/cm3/dwt.h>
+
+/* --- Stage Profile ------------------------------------------------------- */
+
+static struct pipeline_profile profile[PIPELINE_STAGES];
+
+/* Cycle counter when each nested stage was entered, and cycles spent in
+ * the stages it called, which are not charged to it
+ */
+static uint32_t entered[PIPELINE_STAGES];
+static uint32_t nested[PIPELINE_STAGES];
+static int depth;
+
+void pipeline_profile_begin(void)
+{
+    static bool enabled;
+
+    if (!enabled) {
+	enabled = dwt_enable_cycle_counter();
+    }
+    if (depth < PIPELINE_STAGES) {
+	nested[depth] = 0;
+	entered[depth] = dwt_read_cycle_counter();
+    }
+    depth++;
+}
+
+void pipeline_profile_end(enum pipeline_stage_id id, uint32_t length)
+{
+    uint32_t elapsed;
+
+    if (--depth >= PIPELINE_STAGES) {
+	return;
+    }
+    elapsed = dwt_read_cycle_counter() - entered[depth];
+    profile[id].bytes += length;
+    profile[id].cycles += elapsed - nested[depth];
+    if (depth > 0) {
+	nested[depth - 1] += elapsed;
+    }
+}
+
+int pipeline_push(const struct pipeline_stage *stage, uint32_t offset,
+		  const uint8_t *data, uint32_t length)
+{
+    int status;
+
+    pipeline_profile_begin();
+    status = stage->push(stage, offset, data, length);
+    pipeline_profile_end(stage->id, length);
+    return status;
+}
+
+const struct pipeline_profile *pipeline_profile(void)
+{
+    return profile;
+}
+
+#endif
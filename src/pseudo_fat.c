@@ -18,12 +18,19 @@
  */
 
 #include <string.h>
+#include <ctype.h>
+#include <libopencm3/stm32/desig.h>
 #include "pseudo_fat.h"
 
 /* --- Boot Sector and BPB Structure --------------------------------------- */
 
 /* #define USE_DUMMY_CODE */
 
+/* Report the actual image length as the firmware file size, instead of a
+ * file preallocated over the whole application area, which hosts then
+ * overwrite in place */
+/* #define USE_IMAGE_FILE_SIZE */
+
 static const uint8_t BootSector[] = {
     0xEB, 0x3C, 0x90,                                       /*00-02 - BS_jmpBoot */
     'm', 'k', 'f', 's', '.', 'f', 'a', 't',                 /*03-10 - BS_OEMName */
@@ -62,74 +69,94 @@ static const uint8_t BootSector[] = {
 
 /* --- FAT12 Sector Structure ---------------------------------------------- */
 
-#if FLASH_SIZE == (64 * 1024)
-
-static const uint8_t FatSector[] = {
-                      /* Dual Ent,   1st,   2nd, cl1, cl2 */
-    0xF8, 0xFF, 0xFF, /* 0xFFFFF8, 0xFF8, 0xFFF, EOF, EOC */
-    0x00, 0x40, 0x00, /* 0x004000, 0x000, 0x004,   0,   4 */
-    0x05, 0x60, 0x00, /* 0x006005, 0x005, 0x006,   5,   6 */
-    0x07, 0x80, 0x00, /* 0x008007, 0x007, 0x008,   7,   8 */
-    0x09, 0xA0, 0x00, /* 0x00A009, 0x009, 0x00A,   9,  10 */
-    0x0B, 0xC0, 0x00, /* 0x00C00B, 0x00B, 0x00C,  11,  12 */
-    0x0D, 0xE0, 0x00, /* 0x00E00D, 0x00D, 0x00E,  13,  14 */
-    0x0F, 0x00, 0x01, /* 0x01000F, 0x00F, 0x010,  15,  16 */
-    0x11, 0x20, 0x01, /* 0x012011, 0x011, 0x012,  17,  18 */
-    0x13, 0x40, 0x01, /* 0x014013, 0x013, 0x014,  19,  20 */
-    0x15, 0x60, 0x01, /* 0x016015, 0x015, 0x016,  21,  22 */
-    0x17, 0x80, 0x01, /* 0x018017, 0x017, 0x018,  23,  24 */
-    0x19, 0xA0, 0x01, /* 0x01A019, 0x019, 0x01A,  25,  26 */
-    0x1B, 0xC0, 0x01, /* 0x01C01B, 0x01B, 0x01C,  27,  28 */
-    0x1D, 0xE0, 0x01, /* 0x01E01D, 0x01D, 0x01E,  29,  30 */
-    0xFF, 0x0F,       /*    0xFFF, 0xFFF,         EOC     */
-};
+/* The FAT is generated from the geometry: the two reserved entries, then
+ * the checksum pseudo-file in a single cluster, then the firmware
+ * pseudo-file as a single chain from FIRST_CLUSTER to LAST_CLUSTER, then
+ * the optional trace pseudo-file up to TRACE_LAST_CLUSTER.
+ */
 
-#elif FLASH_SIZE == (128 * 1024)
-
-static const uint8_t FatSector[] = {
-                      /* Dual Ent,   1st,   2nd, cl1, cl2 */
-    0xF8, 0xFF, 0xFF, /* 0xFFFFF8, 0xFF8, 0xFFF, EOF, EOC */
-    0x00, 0x40, 0x00, /* 0x004000, 0x000, 0x004,   0,   4 */
-    0x05, 0x60, 0x00, /* 0x006005, 0x005, 0x006,   5,   6 */
-    0x07, 0x80, 0x00, /* 0x008007, 0x007, 0x008,   7,   8 */
-    0x09, 0xA0, 0x00, /* 0x00A009, 0x009, 0x00A,   9,  10 */
-    0x0B, 0xC0, 0x00, /* 0x00C00B, 0x00B, 0x00C,  11,  12 */
-    0x0D, 0xE0, 0x00, /* 0x00E00D, 0x00D, 0x00E,  13,  14 */
-    0x0F, 0x00, 0x01, /* 0x01000F, 0x00F, 0x010,  15,  16 */
-    0x11, 0x20, 0x01, /* 0x012011, 0x011, 0x012,  17,  18 */
-    0x13, 0x40, 0x01, /* 0x014013, 0x013, 0x014,  19,  20 */
-    0x15, 0x60, 0x01, /* 0x016015, 0x015, 0x016,  21,  22 */
-    0x17, 0x80, 0x01, /* 0x018017, 0x017, 0x018,  23,  24 */
-    0x19, 0xA0, 0x01, /* 0x01A019, 0x019, 0x01A,  25,  26 */
-    0x1B, 0xC0, 0x01, /* 0x01C01B, 0x01B, 0x01C,  27,  28 */
-    0x1D, 0xE0, 0x01, /* 0x01E01D, 0x01D, 0x01E,  29,  30 */
-    0x1F, 0x00, 0x02, /* 0x02001F, 0x01F, 0x020,  31,  32 */
-    0x21, 0x20, 0x02, /* 0x022021, 0x021, 0x022,  33,  34 */
-    0x23, 0x40, 0x02, /* 0x024023, 0x023, 0x024,  35,  36 */
-    0x25, 0x60, 0x02, /* 0x026025, 0x025, 0x026,  37,  38 */
-    0x27, 0x80, 0x02, /* 0x028027, 0x027, 0x028,  39,  40 */
-    0x29, 0xA0, 0x02, /* 0x02A029, 0x029, 0x02A,  41,  42 */
-    0x2B, 0xC0, 0x02, /* 0x02C02B, 0x02B, 0x02C,  43,  44 */
-    0x2D, 0xE0, 0x02, /* 0x02E02D, 0x02D, 0x02E,  45,  46 */
-    0x2F, 0x00, 0x03, /* 0x03002F, 0x02F, 0x030,  47,  48 */
-    0x31, 0x20, 0x03, /* 0x032031, 0x031, 0x032,  49,  50 */
-    0x33, 0x40, 0x03, /* 0x034033, 0x033, 0x034,  51,  52 */
-    0x35, 0x60, 0x03, /* 0x036035, 0x035, 0x036,  53,  54 */
-    0x37, 0x80, 0x03, /* 0x038037, 0x037, 0x038,  55,  56 */
-    0x39, 0xA0, 0x03, /* 0x03A039, 0x039, 0x03A,  57,  58 */
-    0x3B, 0xC0, 0x03, /* 0x03C03B, 0x03B, 0x03C,  59,  60 */
-    0x3D, 0xE0, 0x03, /* 0x03E03D, 0x03D, 0x03E,  61,  62 */
-    0xFF, 0x0F,       /*    0xFFF, 0xFFF,        EOC      */
-};
+/* Size of the used part of the FAT in bytes */
+#define FAT_BYTES               ((TRACE_LAST_CLUSTER + 1) * 3 / 2 + 1)
+
+#if FAT_BYTES > FAT_SIZE * BYTES_PER_SECTOR
+#error "The FAT does not fit in FAT_SIZE sectors"
+#endif
+
+#if defined(USE_TRACE) && TRACE_SIZE % FLASH_PAGE_SIZE != 0
+#error "TRACE_SIZE must be a multiple of the cluster size"
+#endif
+
+/* Built once at init, so that the host FAT reads at mount time are a
+ * plain copy
+ */
+static uint8_t FatSector[FAT_BYTES];
+
+#define FAT12_EOC               0xFFF
+
+static uint16_t fat_entry(uint32_t cluster)
+{
+    switch (cluster) {
+    case 0:
 
+        /* The media byte in the low 8 bits, all other bits set */
+        return 0xF00 | FIXED_DISK;
+
+    case 1:
+    case CHECKSUM_CLUSTER:
+    case LAST_CLUSTER:
+#ifdef USE_TRACE
+    case TRACE_LAST_CLUSTER:
 #endif
+        return FAT12_EOC;
+
+    default:
+        return cluster < TRACE_LAST_CLUSTER ? cluster + 1 : 0;
+    }
+}
+
+/* Get a 12-bit entry from a FAT sector written by the host */
+static uint16_t fat_get(const uint8_t *sector, uint32_t cluster)
+{
+    const uint8_t *p = sector + cluster * 3 / 2;
+
+    if (cluster & 1) {
+        return (p[0] >> 4) | (p[1] << 4);
+    }
+    return p[0] | ((p[1] & 0x0F) << 8);
+}
+
+/* Pack the 12-bit entries, two entries in three bytes */
+static void fat_build(void)
+{
+    uint32_t cluster;
+
+    for (cluster = 0; cluster <= TRACE_LAST_CLUSTER; cluster++) {
+	uint16_t entry = fat_entry(cluster);
+	uint8_t *p = FatSector + cluster * 3 / 2;
+
+	if (cluster & 1) {
+	    p[0] |= entry << 4;
+	    p[1] = entry >> 4;
+	} else {
+	    p[0] = entry;
+	    p[1] = entry >> 8;
+	}
+    }
+}
 
 /* --- FAT 32 Byte Directory Entry Structure ------------------------------- */
 
+/* Size of the checksum pseudo-file:
+ *      "LENGTH nnnnnnnn\r\n"
+ *      "CRC32 xxxxxxxx\r\n"
+ *      "SHA256 xxxxxxxx...xxxxxxxx\r\n"
+ */
+#define CHECKSUM_FILE_SIZE      (17 + 16 + 73)
+
 static const uint8_t DirSector[] = {
 
     /* The firmware pseudo-file */
-    'F', 'I', 'R', 'M', 'W', 'A', 'R', 'E', 'T', 'X', 'T',  /*00-10 - DIR_Name */
+    'F', 'I', 'R', 'M', 'W', 'A', 'R', 'E', 'B', 'I', 'N',  /*00-10 - DIR_Name */
     ATTR_ARCHIVE,                                           /*11    - DIR_Attr */
     0,                                                      /*12    - DIR_NTRes */
     0,                                                      /*13    - DIR_CrtTimeTenth */
@@ -140,13 +167,11 @@ static const uint8_t DirSector[] = {
     FAT_TIME(17, 11, 32),                                   /*22-23 - DIR_WrtTime */
     FAT_DATE(25, 12, 2018),                                 /*24-25 - DIR_WrtDate */
     htole16(FIRST_CLUSTER),                                 /*26-27 - DIR_FstClusLO */
-    htole16(RAM_DATA_SIZE),                                 /*28-31 - DIR_FileSize */
+    htole32(MSC_IMAGE_SIZE),                                /*28-31 - DIR_FileSize */
 
-#ifdef USE_VOLUME_ID
-
-    /* The volume ID, order is not important */
-    'B', 'L', 'U', 'E', 'P', 'I', 'L', 'L', ' ', ' ', ' ',  /*32-42 - DIR_Name */
-    ATTR_VOLUME_ID,                                         /*43    - DIR_Attr */
+    /* The read-only checksum pseudo-file */
+    'C', 'H', 'E', 'C', 'K', 'S', 'U', 'M', 'T', 'X', 'T',  /*32-42 - DIR_Name */
+    ATTR_READ_ONLY | ATTR_ARCHIVE,                          /*43    - DIR_Attr */
     0,                                                      /*44    - DIR_NTRes */
     0,                                                      /*45    - DIR_CrtTimeTenth */
     FAT_TIME(17, 11, 32),                                   /*46-47 - DIR_CrtTime */
@@ -155,33 +180,133 @@ static const uint8_t DirSector[] = {
     htole16(0),                                             /*52-53 - DIR_FstClusHI */
     FAT_TIME(17, 11, 32),                                   /*54-55 - DIR_WrtTime */
     FAT_DATE(25, 12, 2018),                                 /*56-57 - DIR_WrtDate */
-    htole16(0),                                             /*58-59 - DIR_FstClusLO */
-    htole16(0),                                             /*60-63 - DIR_FileSize */
+    htole16(CHECKSUM_CLUSTER),                              /*58-59 - DIR_FstClusLO */
+    htole32(CHECKSUM_FILE_SIZE),                            /*60-63 - DIR_FileSize */
+
+#ifdef USE_VOLUME_ID
+
+    /* The volume ID, order is not important */
+    'B', 'L', 'U', 'E', 'P', 'I', 'L', 'L', ' ', ' ', ' ',  /*64-74 - DIR_Name */
+    ATTR_VOLUME_ID,                                         /*75    - DIR_Attr */
+    0,                                                      /*76    - DIR_NTRes */
+    0,                                                      /*77    - DIR_CrtTimeTenth */
+    FAT_TIME(17, 11, 32),                                   /*78-79 - DIR_CrtTime */
+    FAT_DATE(25, 12, 2018),                                 /*80-81 - DIR_CrtDate */
+    FAT_DATE(25, 12, 2018),                                 /*82-83 - DIR_LstAccDate */
+    htole16(0),                                             /*84-85 - DIR_FstClusHI */
+    FAT_TIME(17, 11, 32),                                   /*86-87 - DIR_WrtTime */
+    FAT_DATE(25, 12, 2018),                                 /*88-89 - DIR_WrtDate */
+    htole16(0),                                             /*90-91 - DIR_FstClusLO */
+    htole32(0),                                             /*92-95 - DIR_FileSize */
 
 #endif
 
 };
 
-static uint8_t ram_data[RAM_DATA_SIZE];
+#ifdef USE_TRACE
+
+/* The read-only trace pseudo-file, after the other entries */
+static const uint8_t TraceDirEntry[] = {
+    'T', 'R', 'A', 'C', 'E', ' ', ' ', ' ', 'B', 'I', 'N',  /*00-10 - DIR_Name */
+    ATTR_READ_ONLY | ATTR_ARCHIVE,                          /*11    - DIR_Attr */
+    0,                                                      /*12    - DIR_NTRes */
+    0,                                                      /*13    - DIR_CrtTimeTenth */
+    FAT_TIME(17, 11, 32),                                   /*14-15 - DIR_CrtTime */
+    FAT_DATE(25, 12, 2018),                                 /*16-17 - DIR_CrtDate */
+    FAT_DATE(25, 12, 2018),                                 /*18-19 - DIR_LstAccDate */
+    htole16(0),                                             /*20-21 - DIR_FstClusHI */
+    FAT_TIME(17, 11, 32),                                   /*22-23 - DIR_WrtTime */
+    FAT_DATE(25, 12, 2018),                                 /*24-25 - DIR_WrtDate */
+    htole16(TRACE_CLUSTER),                                 /*26-27 - DIR_FstClusLO */
+    htole32(TRACE_SIZE),                                    /*28-31 - DIR_FileSize */
+};
 
-#define FILL_RAM_DATA
+#endif
 
-int pseudo_fat_init(void)
+/* --- Helpers ------------------------------------------------------------- */
+
+static void put_le32(uint8_t *p, uint32_t value)
 {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
 
-#ifdef FILL_RAM_DATA
+/* --- Checksum Pseudo-File ------------------------------------------------ */
 
+static uint8_t *put_text(uint8_t *p, const char *text)
+{
+    while (*text) {
+        *p++ = *text++;
+    }
+    return p;
+}
+
+static uint8_t *put_hex(uint8_t *p, uint32_t value, int digits)
+{
+    while (digits-- > 0) {
+        *p++ = "0123456789abcdef"[(value >> (digits * 4)) & 0xF];
+    }
+    return p;
+}
+
+static uint8_t *put_decimal(uint8_t *p, uint32_t value, int digits)
+{
     int i;
-    const uint8_t text[] = "USB Mass Storage Class example. ";
 
-    /* Fill RAM data */
-    for (i = 0; i < RAM_DATA_SIZE; i++) {
-        ram_data[i] = text[i % (sizeof (text) - 1)];
+    for (i = digits - 1; i >= 0; i--) {
+        p[i] = '0' + value % 10;
+	value /= 10;
     }
+    return p + digits;
+}
 
-#endif
+/* --- Volume Identity ----------------------------------------------------- */
 
-    return 0;
+/* Volume ID and label, derived from the 96-bit unique device ID so that
+ * hosts can tell several boards apart
+ */
+static uint32_t volume_id;
+static uint8_t volume_label[11];
+
+static void volume_identity_init(void)
+{
+    uint32_t uid[3];
+    int i;
+
+    desig_get_unique_id(uid);
+    volume_id = uid[0] ^ uid[1] ^ uid[2];
+
+    /* "BP-XXXXXXXX", upper case as required for a volume label */
+    put_hex(put_text(volume_label, "BP-"), volume_id, 8);
+    for (i = 0; i < (int) sizeof (volume_label); i++) {
+        volume_label[i] = toupper(volume_label[i]);
+    }
+}
+
+static void checksum_read(uint8_t *sector)
+{
+    const struct image_digest *digest = flash_engine_digest();
+    uint8_t *p = sector;
+    int i;
+
+    p = put_text(p, "LENGTH ");
+    p = put_decimal(p, digest->length, 8);
+    p = put_text(p, "\r\nCRC32 ");
+    p = put_hex(p, digest->crc, 8);
+    p = put_text(p, "\r\nSHA256 ");
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        p = put_hex(p, digest->sha256[i], 2);
+    }
+    put_text(p, "\r\n");
+}
+
+int pseudo_fat_init(void)
+{
+    fat_build();
+    volume_identity_init();
+    return flash_engine_init();
 }
 
 int pseudo_fat_read(uint32_t lba, uint8_t *sector)
@@ -189,13 +314,29 @@ int pseudo_fat_read(uint32_t lba, uint8_t *sector)
     const uint8_t *buffer;
     size_t length;
 
+#ifdef USE_TRACE
+    if (lba >= TRACE_START_SECTOR && lba < TRACE_END_SECTOR) {
+        trace_read((lba - TRACE_START_SECTOR) * BYTES_PER_SECTOR, sector);
+	return 0;
+    }
+    trace_resume();
+#endif
+
+    /* The data section is read through the flash engine, which fills the
+     * whole sector itself
+     */
+    if (lba >= FILEDATA_START_SECTOR && lba < FILEDATA_END_SECTOR) {
+        return flash_engine_read((lba - FILEDATA_START_SECTOR) *
+				 BYTES_PER_SECTOR, sector);
+    }
     memset(sector, 0, BYTES_PER_SECTOR);
     switch (lba) {
     case 0:
 
-        /* Sector 0 is the boot sector */
-        buffer = BootSector;
-	length = sizeof (BootSector);
+        /* Sector 0 is the boot sector, with the device volume identity */
+        memcpy(sector, BootSector, sizeof (BootSector));
+	put_le32(sector + 39, volume_id);
+	memcpy(sector + 43, volume_label, sizeof (volume_label));
 
 	/* Add the boot sector signature (note that this is an
 	 * absolute position in the boot sector), not relative to the
@@ -203,48 +344,164 @@ int pseudo_fat_read(uint32_t lba, uint8_t *sector)
 	 */
 	sector[510] = 0x55;
 	sector[511] = 0xAA;
-	break;
+	return 0;
 
-    case 1:
+    case FAT1_SECTOR:
 
-        /* Sector 1 is the first FAT copy */
+        /* The first FAT copy */
 
-    case 2:
+    case FAT2_SECTOR:
 
-        /* Sector 2 is the second FAT copy */
+        /* The second FAT copy */
         buffer = FatSector;
 	length = sizeof (FatSector);
 	break;
 
-    case 3:
+    case ROOT_DIR_SECTOR:
 
-        /* Sector 3 is the directory entry */
-        buffer = DirSector;
-	length = sizeof (DirSector);
-	break;
+        /* The directory entries */
+	memcpy(sector, DirSector, sizeof (DirSector));
+#ifdef USE_IMAGE_FILE_SIZE
+	put_le32(sector + 28, flash_engine_image_length());
+#endif
+#ifdef USE_VOLUME_ID
+	memcpy(sector + 64, volume_label, sizeof (volume_label));
+#endif
+#ifdef USE_TRACE
+	memcpy(sector + sizeof (DirSector), TraceDirEntry,
+	       sizeof (TraceDirEntry));
+#endif
+	return 0;
+
+    case CHECKSUM_SECTOR:
+
+        /* The checksum pseudo-file, formatted on demand */
+        checksum_read(sector);
+	return 0;
 
     default:
 
-        /* Ignore reads outside of the data section */
-        if (lba >= FILEDATA_START_SECTOR && lba < FILEDATA_END_SECTOR) {
-	    buffer = ram_data + (lba - FILEDATA_START_SECTOR) * BYTES_PER_SECTOR;
-	    length = BYTES_PER_SECTOR;
-	} else {
-	    return 0;
-	}
-	break;
+        /* Unallocated sectors (reserved padding, root directory tail,
+	 * unused clusters) read as zeros
+	 */
+	return 0;
     }
     memcpy(sector, buffer, length);
     return 0;
 }
 
-int pseudo_fat_write(uint32_t lba, const uint8_t *sector)
+/* --- Speculative Pre-Erase ---------------------------------------------- */
+
+/* The data section has been written since startup */
+static bool data_written;
+
+/* The application area has already been queued for erase */
+static bool pre_erase_started;
+
+/*
+ * Detect from the metadata written by the host that the firmware file has
+ * been deleted, or the volume formatted: the first cluster of the firmware
+ * file is freed in the FAT, or the root directory no longer holds a live
+ * FIRMWARE.BIN entry.
+ */
+static bool firmware_is_freed(uint32_t lba, const uint8_t *sector)
 {
+    const uint8_t *entry;
 
-    /* Ignore writes outside of the data section */
+    switch (lba) {
+    case FAT1_SECTOR:
+    case FAT2_SECTOR:
+        return fat_get(sector, FIRST_CLUSTER) == 0;
+
+    case ROOT_DIR_SECTOR:
+        for (entry = sector;
+	     entry < sector + BYTES_PER_SECTOR && entry[0] != DIR_NAME_FREE;
+	     entry += DIR_ENTRY_SIZE) {
+	    if (memcmp(entry, DirSector, 11) == 0 &&
+		(entry[11] & ATTR_LONG_NAME_MASK) != ATTR_LONG_NAME) {
+		return false;
+	    }
+	}
+	return true;
+
+    default:
+        return false;
+    }
+}
+
+static int sector_write(const struct pipeline_stage *stage, uint32_t lba,
+			const uint8_t *sector)
+{
     if (lba >= FILEDATA_START_SECTOR && lba < FILEDATA_END_SECTOR) {
-        memcpy(ram_data + (lba - FILEDATA_START_SECTOR) * BYTES_PER_SECTOR,
-	       sector, BYTES_PER_SECTOR);
+        data_written = true;
+        return pipeline_push(stage->next, (lba - FILEDATA_START_SECTOR) *
+			     BYTES_PER_SECTOR, sector, BYTES_PER_SECTOR);
+    }
+
+    /* Hosts that do not send UNMAP still free the firmware file before
+     * copying a new one: start erasing the application area while the
+     * user is still choosing the file. This is only done before any
+     * data has been written, so that a new image is never erased.
+     */
+    if (!data_written && !pre_erase_started &&
+	firmware_is_freed(lba, sector)) {
+        pre_erase_started = true;
+	return flash_engine_unmap(0, MSC_IMAGE_SIZE);
     }
     return 0;
 }
+
+/*
+ * Write path stage of the firmware drive: the file data sectors are passed
+ * on to the next stage, in bytes from the start of the application area,
+ * and the file system sectors are consumed.
+ */
+int pseudo_fat_push(const struct pipeline_stage *stage, uint32_t offset,
+		    const uint8_t *data, uint32_t length)
+{
+    uint32_t i;
+
+    for (i = 0; i < length; i += BYTES_PER_SECTOR) {
+        if (sector_write(stage, (offset + i) / BYTES_PER_SECTOR,
+			 data + i) < 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Only the file data sectors can be received by the next stage in place */
+uint8_t *pseudo_fat_claim(const struct pipeline_stage *stage,
+			  uint32_t offset)
+{
+    uint32_t lba = offset / BYTES_PER_SECTOR;
+
+    if (lba < FILEDATA_START_SECTOR || lba >= FILEDATA_END_SECTOR) {
+        return NULL;
+    }
+    return pipeline_claim(stage->next, (lba - FILEDATA_START_SECTOR) *
+			  BYTES_PER_SECTOR);
+}
+
+int pseudo_fat_flush(void)
+{
+    return flash_engine_flush();
+}
+
+int pseudo_fat_unmap(uint32_t lba, uint32_t count)
+{
+    uint32_t end = lba + count;
+
+    /* Only the data section is backed by the flash memory */
+    if (lba < FILEDATA_START_SECTOR) {
+        lba = FILEDATA_START_SECTOR;
+    }
+    if (end > FILEDATA_END_SECTOR) {
+        end = FILEDATA_END_SECTOR;
+    }
+    if (lba >= end) {
+        return 0;
+    }
+    return flash_engine_unmap((lba - FILEDATA_START_SECTOR) * BYTES_PER_SECTOR,
+			      (end - lba) * BYTES_PER_SECTOR);
+}
@@ -0,0 +1,145 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "sha256.h"
+
+/* --- SHA-256 ------------------------------------------------------------- */
+
+/* For more details, see "FIPS PUB 180-4, Secure Hash Standard (SHS)",
+ * National Institute of Standards and Technology, August 2015.
+ *
+ * This is a small rather than fast implementation: it only runs on demand
+ * over the application image.
+ */
+
+static const uint32_t k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+    0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+    0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+    0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+    0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+    0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+#define ROR(x, n)               (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_transform(struct sha256_ctx *ctx)
+{
+    uint32_t w[16];
+    uint32_t s[8];
+    uint32_t t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+	w[i] = ((uint32_t) ctx->block[i * 4] << 24) |
+	    ((uint32_t) ctx->block[i * 4 + 1] << 16) |
+	    ((uint32_t) ctx->block[i * 4 + 2] << 8) |
+	    ctx->block[i * 4 + 3];
+    }
+    memcpy(s, ctx->state, sizeof (s));
+    for (i = 0; i < 64; i++) {
+
+	/* The message schedule is kept in a 16-word circular buffer */
+	if (i >= 16) {
+	    uint32_t w1 = w[(i - 15) & 15];
+	    uint32_t w14 = w[(i - 2) & 15];
+
+	    w[i & 15] += (ROR(w14, 17) ^ ROR(w14, 19) ^ (w14 >> 10)) +
+		w[(i - 7) & 15] +
+		(ROR(w1, 7) ^ ROR(w1, 18) ^ (w1 >> 3));
+	}
+	t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+	    ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i & 15];
+	t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+	    ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+	memmove(s + 1, s, 7 * sizeof (s[0]));
+	s[4] += t1;
+	s[0] = t1 + t2;
+    }
+    for (i = 0; i < 8; i++) {
+	ctx->state[i] += s[i];
+    }
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+    static const uint32_t h[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+    };
+
+    memcpy(ctx->state, h, sizeof (h));
+    ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+	size_t index = ctx->count % SHA256_BLOCK_SIZE;
+	size_t chunk = SHA256_BLOCK_SIZE - index;
+
+	if (chunk > length) {
+	    chunk = length;
+	}
+	memcpy(ctx->block + index, data, chunk);
+	ctx->count += chunk;
+	data += chunk;
+	length -= chunk;
+	if (index + chunk == SHA256_BLOCK_SIZE) {
+	    sha256_transform(ctx);
+	}
+    }
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    uint32_t bits = ctx->count * 8;
+    size_t index = ctx->count % SHA256_BLOCK_SIZE;
+    int i;
+
+    /* Append the 0x80 terminator, then pad with zeros up to the 64-bit
+     * big-endian message length in bits.
+     */
+    ctx->block[index++] = 0x80;
+    if (index > SHA256_BLOCK_SIZE - 8) {
+	memset(ctx->block + index, 0, SHA256_BLOCK_SIZE - index);
+	sha256_transform(ctx);
+	index = 0;
+    }
+    memset(ctx->block + index, 0, SHA256_BLOCK_SIZE - 4 - index);
+    for (i = 0; i < 4; i++) {
+	ctx->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+    }
+    sha256_transform(ctx);
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+	digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
@@ -0,0 +1,399 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+#include "spi_nor.h"
+#include "buffer_pool.h"
+
+/* --- SPI NOR Commands ---------------------------------------------------- */
+
+#define NOR_WRITE_ENABLE        0x06
+#define NOR_READ_STATUS         0x05
+#define NOR_PAGE_PROGRAM        0x02
+#define NOR_FAST_READ           0x0B
+#define NOR_SECTOR_ERASE        0x20
+#define NOR_READ_JEDEC_ID       0x9F
+
+/* Write In Progress status bit */
+#define NOR_STATUS_WIP          0x01
+
+/* Capacity codes of the JEDEC ID (log2 of the size in bytes) accepted
+ * with 3-byte addresses, from 64KB to 16MB
+ */
+#define NOR_CAPACITY_MIN        16
+#define NOR_CAPACITY_MAX        24
+
+/* SPI1 DMA channels */
+#define SPI_RX_DMA_CHANNEL      DMA_CHANNEL2
+#define SPI_TX_DMA_CHANNEL      DMA_CHANNEL3
+
+/* Longest DMA transfer, the channel counter being 16-bit */
+#define SPI_DMA_MAX             32768
+
+#define SECTOR_NONE             0xFFFFFFFF
+
+/* --- Sector Write-Back Buffer -------------------------------------------- */
+
+/* Written blocks are gathered in RAM per erase sector. The whole sector is
+ * read first, so that it can be erased ahead, as soon as a block needing
+ * an erase is written, while the host sends the rest of the sector. The
+ * sector is programmed when it is evicted by a write to another sector,
+ * flushed, or after the idle timeout. The buffer is taken from the buffer
+ * pool on the first write, and given back once the sector is programmed.
+ */
+static struct {
+    uint8_t *data;
+
+    /* Address of the buffered sector, SECTOR_NONE if none */
+    uint32_t address;
+
+    /* An erase of the sector has been started */
+    bool erasing;
+
+    /* Bitmap of the modified program pages */
+    uint16_t dirty;
+} sector = {
+    .address = SECTOR_NONE,
+};
+
+static uint32_t nor_size;
+static uint32_t idle_ms;
+
+/* --- SPI Transfers ------------------------------------------------------- */
+
+static void nor_select(void)
+{
+    GPIO_BSRR(GPIOA) = GPIO4 << 16;
+}
+
+static void nor_deselect(void)
+{
+    GPIO_BSRR(GPIOA) = GPIO4;
+}
+
+static void dma_setup(uint8_t channel, uint8_t *memory, bool increment,
+		      uint16_t length)
+{
+    dma_channel_reset(DMA1, channel);
+    dma_set_peripheral_address(DMA1, channel, (uint32_t) &SPI_DR(SPI1));
+    dma_set_memory_address(DMA1, channel, (uint32_t) memory);
+    dma_set_number_of_data(DMA1, channel, length);
+    dma_set_peripheral_size(DMA1, channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, channel, DMA_CCR_PL_VERY_HIGH);
+    if (increment) {
+	dma_enable_memory_increment_mode(DMA1, channel);
+    }
+}
+
+/*
+ * Move length bytes at the SPI bus rate, the CPU only waiting for the
+ * receive channel to complete. A NULL rx discards the received bytes, a
+ * NULL tx sends 0xFF bytes.
+ */
+static void spi_dma(uint8_t *rx, const uint8_t *tx, uint16_t length)
+{
+    static uint8_t sink;
+    static const uint8_t filler = 0xFF;
+
+    dma_setup(SPI_RX_DMA_CHANNEL, rx != NULL ? rx : &sink, rx != NULL,
+	      length);
+    dma_set_read_from_peripheral(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_setup(SPI_TX_DMA_CHANNEL,
+	      (uint8_t *) (tx != NULL ? tx : &filler), tx != NULL, length);
+    dma_set_read_from_memory(DMA1, SPI_TX_DMA_CHANNEL);
+
+    dma_enable_channel(DMA1, SPI_RX_DMA_CHANNEL);
+    dma_enable_channel(DMA1, SPI_TX_DMA_CHANNEL);
+    spi_enable_rx_dma(SPI1);
+    spi_enable_tx_dma(SPI1);
+    while (!dma_get_interrupt_flag(DMA1, SPI_RX_DMA_CHANNEL, DMA_TCIF));
+    spi_disable_tx_dma(SPI1);
+    spi_disable_rx_dma(SPI1);
+    dma_disable_channel(DMA1, SPI_TX_DMA_CHANNEL);
+    dma_disable_channel(DMA1, SPI_RX_DMA_CHANNEL);
+}
+
+/* Select the chip and send a command, with a 3-byte address if any */
+static void nor_command(uint8_t command, uint32_t address, bool has_address)
+{
+    nor_select();
+    spi_xfer(SPI1, command);
+    if (has_address) {
+	spi_xfer(SPI1, (address >> 16) & 0xFF);
+	spi_xfer(SPI1, (address >> 8) & 0xFF);
+	spi_xfer(SPI1, address & 0xFF);
+    }
+}
+
+static void nor_wait_ready(void)
+{
+    nor_command(NOR_READ_STATUS, 0, false);
+    while (spi_xfer(SPI1, 0xFF) & NOR_STATUS_WIP);
+    nor_deselect();
+}
+
+static void nor_write_enable(void)
+{
+    nor_wait_ready();
+    nor_command(NOR_WRITE_ENABLE, 0, false);
+    nor_deselect();
+}
+
+static void nor_read(uint32_t address, uint8_t *data, uint32_t length)
+{
+    uint32_t chunk;
+
+    nor_wait_ready();
+    nor_command(NOR_FAST_READ, address, true);
+    spi_xfer(SPI1, 0xFF);
+    for (; length > 0; data += chunk, length -= chunk) {
+	chunk = length < SPI_DMA_MAX ? length : SPI_DMA_MAX;
+	spi_dma(data, NULL, chunk);
+    }
+    nor_deselect();
+}
+
+/* Start a page program or a sector erase, without waiting for its end */
+static void nor_program(uint32_t address, const uint8_t *data)
+{
+    nor_write_enable();
+    nor_command(NOR_PAGE_PROGRAM, address, true);
+    spi_dma(NULL, data, SPI_NOR_PAGE_SIZE);
+    nor_deselect();
+}
+
+static void nor_erase(uint32_t address)
+{
+    nor_write_enable();
+    nor_command(NOR_SECTOR_ERASE, address, true);
+    nor_deselect();
+}
+
+/* --- Sector Buffer Handling ---------------------------------------------- */
+
+static bool is_blank(const uint8_t *data, uint32_t length)
+{
+    const uint32_t *p = (const uint32_t *) data;
+
+    for (length /= 4; length > 0; length--) {
+	if (*p++ != 0xFFFFFFFF) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/* Whether programming data over old needs an erase first, i.e. some bit
+ * has to go from 0 back to 1
+ */
+static bool needs_erase(const uint8_t *old, const uint8_t *data)
+{
+    const uint32_t *p = (const uint32_t *) old;
+    const uint32_t *q = (const uint32_t *) data;
+    int i;
+
+    for (i = 0; i < SPI_NOR_BLOCK_SIZE / 4; i++) {
+	if (~p[i] & q[i]) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+ * Program the modified pages of the buffered sector, or all its non-blank
+ * pages after an erase. The last program is left running, the next command
+ * waits for it.
+ */
+static void sector_write_back(void)
+{
+    int page;
+
+    if (sector.dirty == 0) {
+	return;
+    }
+    for (page = 0; page < SPI_NOR_SECTOR_SIZE / SPI_NOR_PAGE_SIZE; page++) {
+	const uint8_t *data = sector.data + page * SPI_NOR_PAGE_SIZE;
+
+	if (sector.erasing ? !is_blank(data, SPI_NOR_PAGE_SIZE) :
+	    (sector.dirty & (1 << page)) != 0) {
+	    nor_program(sector.address + page * SPI_NOR_PAGE_SIZE, data);
+	}
+    }
+    sector.erasing = false;
+    sector.dirty = 0;
+}
+
+/* Write back the buffered sector and give its buffer back */
+static void sector_release(void)
+{
+    sector_write_back();
+    buffer_release(sector.data);
+    sector.data = NULL;
+    sector.address = SECTOR_NONE;
+}
+
+/* --- Public API ---------------------------------------------------------- */
+
+/*
+ * Set up SPI1 at 18MHz (the fastest rate of the STM32F103 SPI) and
+ * identify the chip, once. Returns -1 if there is none.
+ */
+int spi_nor_init(void)
+{
+    uint8_t manufacturer, capacity;
+
+    if (nor_size != 0) {
+	return 0;
+    }
+
+    RCC_APB2ENR |= RCC_APB2ENR_IOPAEN | RCC_APB2ENR_SPI1EN;
+    RCC_AHBENR |= RCC_AHBENR_DMA1EN;
+
+    nor_deselect();
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ,
+		  GPIO_CNF_OUTPUT_PUSHPULL, GPIO4);
+    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ,
+		  GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO5 | GPIO7);
+    gpio_set_mode(GPIOA, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, GPIO6);
+
+    spi_init_master(SPI1, SPI_CR1_BAUDRATE_FPCLK_DIV_4,
+		    SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+		    SPI_CR1_CPHA_CLK_TRANSITION_1,
+		    SPI_CR1_DFF_8BIT, SPI_CR1_MSBFIRST);
+    spi_enable_software_slave_management(SPI1);
+    spi_set_nss_high(SPI1);
+    spi_enable(SPI1);
+
+    nor_command(NOR_READ_JEDEC_ID, 0, false);
+    manufacturer = spi_xfer(SPI1, 0xFF);
+    spi_xfer(SPI1, 0xFF);
+    capacity = spi_xfer(SPI1, 0xFF);
+    nor_deselect();
+
+    if (manufacturer == 0x00 || manufacturer == 0xFF ||
+	capacity < NOR_CAPACITY_MIN || capacity > NOR_CAPACITY_MAX) {
+	return -1;
+    }
+    nor_size = 1UL << capacity;
+    return 0;
+}
+
+uint32_t spi_nor_size(void)
+{
+    return nor_size;
+}
+
+/* Read from the chip, with the buffered sector contents overlaid */
+int spi_nor_read(uint32_t offset, uint8_t *data, uint32_t length)
+{
+    uint32_t start, end;
+
+    if (offset > nor_size || length > nor_size - offset) {
+	return -1;
+    }
+    nor_read(offset, data, length);
+    if (sector.address != SECTOR_NONE) {
+	start = offset > sector.address ? offset : sector.address;
+	end = offset + length < sector.address + SPI_NOR_SECTOR_SIZE ?
+	    offset + length : sector.address + SPI_NOR_SECTOR_SIZE;
+	if (start < end) {
+	    memcpy(data + start - offset,
+		   sector.data + start - sector.address, end - start);
+	}
+    }
+    return 0;
+}
+
+int spi_nor_write(uint32_t offset, const uint8_t *block)
+{
+    uint32_t address = offset & ~(SPI_NOR_SECTOR_SIZE - 1);
+    uint32_t index = offset - address;
+    uint8_t *p;
+
+    if (offset >= nor_size || (offset % SPI_NOR_BLOCK_SIZE) != 0) {
+	return -1;
+    }
+    idle_ms = 0;
+    if (sector.data == NULL) {
+	sector.data = buffer_alloc(SPI_NOR_SECTOR_SIZE / BUFFER_SIZE,
+				   BUFFER_SPI_NOR);
+	if (sector.data == NULL) {
+	    return -1;
+	}
+    }
+    if (sector.address != address) {
+	sector_write_back();
+	nor_read(address, sector.data, SPI_NOR_SECTOR_SIZE);
+	sector.address = address;
+    }
+    p = sector.data + index;
+    if (memcmp(p, block, SPI_NOR_BLOCK_SIZE) == 0) {
+	return 0;
+    }
+    if (!sector.erasing && needs_erase(p, block)) {
+	nor_erase(address);
+	sector.erasing = true;
+    }
+    memcpy(p, block, SPI_NOR_BLOCK_SIZE);
+    sector.dirty |= ((1 << (SPI_NOR_BLOCK_SIZE / SPI_NOR_PAGE_SIZE)) - 1) <<
+	(index / SPI_NOR_PAGE_SIZE);
+    return 0;
+}
+
+/* Write back the buffered sector, and wait until it is programmed */
+int spi_nor_flush(void)
+{
+    sector_release();
+    nor_wait_ready();
+    return 0;
+}
+
+/* Write back the buffered sector once the bus has been idle for a while */
+void spi_nor_tick(void)
+{
+    if (++idle_ms >= SPI_NOR_FLUSH_IDLE_MS && sector.data != NULL) {
+	sector_release();
+    }
+}
+
+int spi_nor_read_block(uint32_t lba, uint8_t *block)
+{
+    return spi_nor_read(lba * SPI_NOR_BLOCK_SIZE, block, SPI_NOR_BLOCK_SIZE);
+}
+
+/* Write path stage of the external flash logical unit */
+int spi_nor_push(const struct pipeline_stage *stage, uint32_t offset,
+		 const uint8_t *data, uint32_t length)
+{
+    uint32_t i;
+
+    (void) stage;
+    for (i = 0; i < length; i += SPI_NOR_BLOCK_SIZE) {
+	if (spi_nor_write(offset + i, data + i) < 0) {
+	    return -1;
+	}
+    }
+    return 0;
+}
@@ -18,13 +18,44 @@
  */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/desig.h>
 #include <libopencm3/usb/usbd.h>
-#include <libopencm3/usb/msc.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/vector.h>
 #include "pseudo_fat.h"
+#include "spi_nor.h"
+#include "msc.h"
+#include "buffer_pool.h"
+#include "bootloader_request.h"
+#include "trace.h"
+
+/* Delay between an eject and the soft-disconnect, for the CSW to reach
+ * the host */
+#define EJECT_CSW_MS            20
+
+/* Time the D+ pull-up is released before resetting into the application */
+#define EJECT_DISCONNECT_MS     50
+
+/* Also commit an update and start the application after the idle timeout,
+ * for hosts that never eject the medium. A host that stalls for that long
+ * in the middle of the copy then gets a truncated image started. */
+/* #define BOOT_ON_IDLE_COMMIT */
+
+/* Expose an external SPI NOR flash on SPI1, if one is found, as a second
+ * logical unit (see spi_nor.h for the wiring) */
+/* #define USE_SPI_NOR */
+
+/* The external flash sector buffer comes from the buffer pool */
+#if (defined(USE_SPI_NOR) || defined(USE_SPI_NOR_STAGING)) && \
+	BUFFER_POOL_COUNT < 1 + FLASH_PAGE_SLOTS * FLASH_PAGE_SIZE / BUFFER_SIZE + \
+	SPI_NOR_SECTOR_SIZE / BUFFER_SIZE
+#error "Increase BUFFER_POOL_COUNT for the SPI NOR flash (see buffer_pool.h)"
+#endif
 
 static const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
@@ -91,20 +122,152 @@ static const struct usb_config_descriptor config = {
 	.interface = ifaces,
 };
 
+/* Serial number, the 96-bit unique device ID in hexadecimal, so that
+ * several boards can be told apart by the host
+ */
+static char serial_number[25];
+
 static const char *usb_strings[] = {
 	"http://www.stm32duino.com",
 	"MSC Bootloader",
-	"BluePill",
+	serial_number,
 };
 
 /* Buffer to be used for control requests. */
 static uint8_t usbd_control_buffer[128];
 
+/* Milliseconds elapsed since the medium has been ejected, 0 if not */
+static uint32_t eject_ms;
+
+static void msc_eject(void)
+{
+	eject_ms = 1;
+}
+
+static const struct msc_flash flash = {
+	.size = MSC_IMAGE_SIZE,
+	.erase_size = FLASH_PAGE_SIZE,
+	.write = flash_engine_write_direct,
+	.erase = flash_engine_unmap,
+	.crc = flash_engine_crc,
+	.reboot = msc_eject,
+	.journal_open = flash_engine_journal_open,
+	.journal_page = flash_engine_journal_page,
+};
+
+/* Write paths, chained at build time: the firmware drive blocks go through
+ * the FAT volume emulation to the flash engine, and the SPI NOR flash drive
+ * blocks straight to the chip
+ */
+static const struct pipeline_stage program_stage = {
+	.id = PIPELINE_PROGRAM,
+	.push = flash_engine_push,
+	.claim = flash_engine_claim,
+};
+
+static const struct pipeline_stage firmware_pipeline = {
+	.id = PIPELINE_FAT,
+	.push = pseudo_fat_push,
+	.claim = pseudo_fat_claim,
+	.next = &program_stage,
+};
+
+#ifdef USE_SPI_NOR
+static const struct pipeline_stage spi_nor_pipeline = {
+	.id = PIPELINE_SPI_NOR,
+	.push = spi_nor_push,
+};
+#endif
+
+/* The internal flash FAT volume, then the optional SPI NOR flash, whose
+ * size is only known once the chip has been identified
+ */
+static struct msc_lun luns[] = {{
+	.block_count = TOTAL_SECTORS,
+	.read_block = pseudo_fat_read,
+	.write_pipeline = &firmware_pipeline,
+	.flush = pseudo_fat_flush,
+	.unmap = pseudo_fat_unmap,
+	.granularity = FLASH_PAGE_SIZE / MSC_BLOCK_SIZE,
+	.optimal_transfer = FLASH_PAGE_SLOTS * FLASH_PAGE_SIZE / MSC_BLOCK_SIZE,
+	.flash = &flash,
+	.eject = msc_eject,
+#ifdef USE_SPI_NOR
+}, {
+	.read_block = spi_nor_read_block,
+	.write_pipeline = &spi_nor_pipeline,
+	.flush = spi_nor_flush,
+	.granularity = SPI_NOR_SECTOR_SIZE / MSC_BLOCK_SIZE,
+#endif
+}};
+
+/* Linker script symbols */
+extern unsigned _data_loadaddr, _data, _edata, _ebss;
+
+/*
+ * An update is requested either by setting the BOOT1 jumper (PB2) to 1, or
+ * by the application writing the magic value to the backup data register
+ * before resetting (see bootloader_request.h). The magic is cleared, and
+ * the GPIOB, PWR and BKP clocks are switched off again so that the
+ * application starts with the peripherals in their reset state.
+ */
+static bool update_is_requested(void)
+{
+	bool requested;
+
+	RCC_APB2ENR |= RCC_APB2ENR_IOPBEN;
+	RCC_APB1ENR |= RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN;
+
+	/* Dummy read to make sure the clocks are running before sampling */
+	(void) RCC_APB1ENR;
+	requested = (GPIO_IDR(GPIOB) & GPIO2) != 0;
+	if ((BOOTLOADER_REQUEST_REG & 0xFFFF) == BOOTLOADER_REQUEST_MAGIC) {
+		bootloader_request_write(0);
+		requested = true;
+	}
+	RCC_APB2ENR &= ~RCC_APB2ENR_IOPBEN;
+	RCC_APB1ENR &= ~(RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+	return requested;
+}
+
+static void jump_to_application(void) __attribute__ ((noreturn));
+
+static void jump_to_application(void)
+{
+	const uint32_t *vectors = (const uint32_t *) MSC_FIRMWARE_ORIGIN;
+
+	SCB_VTOR = MSC_FIRMWARE_ORIGIN;
+	__asm__ volatile ("msr msp, %0\n\t"
+			  "bx %1"
+			  : : "r" (vectors[0]), "r" (vectors[1]));
+	while (1);
+}
+
+/*
+ * Once the medium has been ejected, commit the update, soft-disconnect and
+ * reset, so that the new application is started by the fast boot path.
+ */
+static void eject_tick(void)
+{
+	if (eject_ms == 0) {
+		return;
+	}
+	eject_ms++;
+	if (eject_ms == EJECT_CSW_MS) {
+		flash_engine_commit();
+
+		/* Release the D+ pull-up */
+		GPIO_BSRR(GPIOC) = GPIO12;
+	} else if (eject_ms == EJECT_CSW_MS + EJECT_DISCONNECT_MS) {
+		scb_reset_system();
+	}
+}
+
 int main(void)
 {
+	usbd_mass_storage *ms;
 	static usbd_device *usbd_dev;
-
-	//SCB_VTOR = (uint32_t) 0x08002000;
+	uint8_t lun_count = 1;
 
 	/* RCC Set System Clock PLL at 72MHz from HSE at 8MHz */
 	/* Enable internal high-speed oscillator. */
@@ -173,6 +336,14 @@ int main(void)
 	RCC_CFGR = (RCC_CFGR & ~RCC_CFGR_SW) |
 	  (RCC_CFGR_SW_SYSCLKSEL_PLLCLK << RCC_CFGR_SW_SHIFT);
 
+	trace_init();
+
+	/* Start the application once an update whose copy from the staging
+	 * area was interrupted has been completed */
+	if (pseudo_fat_init() > 0) {
+		scb_reset_system();
+	}
+
 	/* Enable clocks for GPIOA and GPIOC */
 	RCC_APB2ENR |= (1 << 2) | (1 << 4);
 
@@ -185,15 +356,82 @@ int main(void)
 		     (GPIO_CNF_OUTPUT_OPENDRAIN << 18));
 	GPIO_BSRR(GPIOC) = (GPIO12 << 16);
 
+	desig_get_unique_id_as_string(serial_number, sizeof (serial_number));
 	usbd_dev = usbd_init(&st_usbfs_v1_usb_driver, &dev, &config,
 			     usb_strings, 3, usbd_control_buffer,
 			     sizeof (usbd_control_buffer));
 
-	pseudo_fat_init();
-	usb_msc_init(usbd_dev, 0x82, 64, 0x01, 64, "BluePill", "stm32duino.com",
-		     "0.01", TOTAL_SECTORS, pseudo_fat_read, pseudo_fat_write);
+#ifdef USE_SPI_NOR
+
+	/* The end of the chip may be reserved for staging updates */
+	if (spi_nor_init() == 0 &&
+	    spi_nor_size() > flash_engine_staging_size()) {
+		luns[1].block_count = (spi_nor_size() -
+				       flash_engine_staging_size()) /
+			MSC_BLOCK_SIZE;
+		lun_count++;
+	}
+#endif
+	ms = msc_init(usbd_dev, 0x82, 64, 0x01, 64, "BluePill",
+		      "stm32duino.com", "0.01", luns, lun_count);
+
+	/* 1ms SysTick, polled from the main loop */
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+	systick_set_reload(72000 - 1);
+	systick_counter_enable();
 
 	while (1) {
 		usbd_poll(usbd_dev);
+		if (systick_get_countflag()) {
+			if (flash_engine_tick()) {
+
+				/* Once the bus is idle, make the host drop
+				 * what it cached of a FIRMWARE.BIN changed
+				 * behind its back
+				 */
+				if (flash_engine_changed()) {
+					msc_medium_changed(ms, 0);
+				}
+#ifdef BOOT_ON_IDLE_COMMIT
+				msc_eject();
+#endif
+			}
+#ifdef USE_SPI_NOR
+			spi_nor_tick();
+#endif
+			trace_tick();
+			eject_tick();
+		}
+	}
+}
+
+/*
+ * Replaces the weak libopencm3 reset handler, so that the boot decision is
+ * taken first thing out of reset, still running from the 8MHz HSI and
+ * before the .data/.bss initialization (zeroing the RAM buffers alone takes
+ * milliseconds at that clock). The bootloader has no constructors, so the
+ * init arrays are not walked.
+ */
+void reset_handler(void)
+{
+	volatile unsigned *src, *dest;
+
+	if (!update_is_requested() && flash_engine_image_is_bootable()) {
+		jump_to_application();
+	}
+
+	for (src = &_data_loadaddr, dest = &_data;
+	     dest < &_edata;
+	     src++, dest++) {
+		*dest = *src;
+	}
+	while (dest < &_ebss) {
+		*dest++ = 0;
 	}
+
+	/* Ensure 8-byte alignment of stack pointer on interrupts */
+	SCB_CCR |= SCB_CCR_STKALIGN;
+
+	main();
+	while (1);
 }
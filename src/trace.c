@@ -0,0 +1,100 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#ifdef USE_TRACE
+
+#include <string.h>
+#include <stdbool.h>
+#include <libopencm3/cm3/dwt.h>
+
+/* --- Ring Buffer --------------------------------------------------------- */
+
+/* Left in .bss, the header being filled in at startup, so that the ring
+ * buffer does not take any flash for its initial image
+ */
+static struct {
+    struct trace_header header;
+    struct trace_entry entries[TRACE_ENTRIES];
+} trace;
+
+/* Logging is paused while TRACE.BIN is read, so that the host gets a
+ * consistent snapshot rather than the trace of its own reads
+ */
+static bool paused;
+
+/* Milliseconds elapsed since the last read of TRACE.BIN */
+static uint32_t pause_ms;
+
+void trace_init(void)
+{
+    trace.header.magic = TRACE_MAGIC;
+    trace.header.version = TRACE_VERSION;
+    trace.header.entry_size = sizeof (struct trace_entry);
+    trace.header.clock_hz = TRACE_CLOCK_HZ;
+    dwt_enable_cycle_counter();
+}
+
+void trace_log(enum trace_event event, uint16_t arg, uint32_t a, uint32_t b)
+{
+    struct trace_entry *entry;
+
+    if (paused) {
+	return;
+    }
+    entry = &trace.entries[trace.header.total++ % TRACE_ENTRIES];
+    entry->time = dwt_read_cycle_counter();
+    entry->event = event;
+    entry->arg = arg;
+    entry->a = a;
+    entry->b = b;
+}
+
+/*
+ * Read a sector of TRACE.BIN: logging is paused until its last sector has
+ * been read. A host may also stop short of it (a partial read, a reader
+ * killed, readahead cancelled), so logging also resumes as soon as it
+ * reads another sector, or after TRACE_PAUSE_MS.
+ */
+void trace_read(uint32_t offset, uint8_t *sector)
+{
+    paused = true;
+    pause_ms = 0;
+    memcpy(sector, (const uint8_t *) &trace + offset, TRACE_BLOCK_SIZE);
+    if (offset + TRACE_BLOCK_SIZE >= TRACE_SIZE) {
+	paused = false;
+    }
+}
+
+/* The host has read a sector outside TRACE.BIN */
+void trace_resume(void)
+{
+    paused = false;
+}
+
+/* Called every millisecond from the main loop */
+void trace_tick(void)
+{
+    if (paused && ++pause_ms >= TRACE_PAUSE_MS) {
+	paused = false;
+    }
+}
+
+#endif
@@ -0,0 +1,390 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Flash several bootloader boards concurrently, one thread per board, and
+ * report the per-board and aggregate throughput. The boards are found by
+ * their INQUIRY vendor and told apart by their USB serial number, or given
+ * as device paths, or as volume image files for testing.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "msc_device.h"
+
+#define MAX_BOARDS              32
+#define MAX_SERIALS             MAX_BOARDS
+
+/* Write size: a few flash pages in block mode, more with the fast-flash
+ * commands, which have no file system to go through
+ */
+#define BLOCK_CHUNK_SIZE        4096
+#define FLASH_CHUNK_SIZE        16384
+
+enum mode {
+	MODE_BLOCK,
+	MODE_FLASH,
+};
+
+struct board {
+	struct msc_device dev;
+	pthread_t thread;
+	double seconds;
+	const char *error;
+	int error_number;
+
+	/* Bytes not sent again when resuming an interrupted upload */
+	uint32_t skipped;
+};
+
+static enum mode mode = MODE_BLOCK;
+static bool no_reboot;
+static uint8_t *image;
+static uint32_t image_size;
+
+/* Image size padded to a whole number of blocks, with erased bytes */
+static uint32_t padded_size;
+
+/* CRC of the padded image, which identifies its upload journal */
+static uint32_t image_crc;
+
+static int fail(struct board *board, const char *error)
+{
+	board->error = error;
+	board->error_number = errno;
+	return -1;
+}
+
+static int flash_block(struct board *board)
+{
+	struct msc_device *dev = &board->dev;
+	uint8_t *readback;
+	uint32_t offset;
+	int status = 0;
+
+	if (msc_device_locate_firmware(dev) < 0) {
+		return fail(board, "no firmware file");
+	}
+	if (padded_size > dev->firmware_size) {
+		errno = EFBIG;
+		return fail(board, "image larger than the firmware file");
+	}
+	for (offset = 0; offset < padded_size; offset += BLOCK_CHUNK_SIZE) {
+		uint32_t size = padded_size - offset;
+
+		if (size > BLOCK_CHUNK_SIZE) {
+			size = BLOCK_CHUNK_SIZE;
+		}
+		if (pwrite(dev->fd, image + offset, size,
+			   dev->firmware_offset + offset) != (ssize_t) size) {
+			return fail(board, "write");
+		}
+	}
+	if (msc_device_sync(dev) < 0) {
+		return fail(board, "synchronize cache");
+	}
+
+	readback = msc_device_alloc(padded_size);
+	if (readback == NULL) {
+		return fail(board, "out of memory");
+	}
+	if (pread(dev->fd, readback, padded_size, dev->firmware_offset) !=
+	    (ssize_t) padded_size) {
+		status = fail(board, "read back");
+	} else if (memcmp(readback, image, padded_size) != 0) {
+		errno = EIO;
+		status = fail(board, "verify");
+	}
+	free(readback);
+	if (status == 0 && !no_reboot && msc_device_eject(dev) < 0) {
+		return fail(board, "eject");
+	}
+	return status;
+}
+
+/*
+ * Whether a page of the image has already been programmed during an
+ * interrupted upload, its journal CRC matching the image page padded with
+ * erased bytes.
+ */
+static bool page_is_done(const struct msc_journal *journal, uint32_t offset)
+{
+	uint32_t size = journal->page_size;
+	uint32_t length = padded_size - offset;
+	uint8_t *page;
+	uint32_t crc;
+	bool done;
+
+	if (!msc_journal_page(journal, offset / size, &crc)) {
+		return false;
+	}
+	page = malloc(size);
+	if (page == NULL) {
+		return false;
+	}
+	memset(page, 0xFF, size);
+	memcpy(page, image + offset, length < size ? length : size);
+	done = msc_crc32(page, size) == crc;
+	free(page);
+	return done;
+}
+
+static int flash_direct(struct board *board)
+{
+	struct msc_device *dev = &board->dev;
+	struct msc_journal journal;
+	uint32_t offset, crc, unit;
+	uint32_t start = 0, pending = 0;
+	bool resume;
+
+	/* Bootloaders without the journal command are flashed in full */
+	resume = msc_device_flash_journal(dev, image_crc, &journal) == 0 &&
+		journal.resumed &&
+		journal.page_size % MSC_DEVICE_BLOCK_SIZE == 0;
+	unit = resume ? journal.page_size : FLASH_CHUNK_SIZE;
+
+	/* Pages left to write are gathered in runs of up to a chunk */
+	for (offset = 0; offset < padded_size || pending > 0;
+	     offset += unit) {
+		uint32_t size = offset < padded_size ? padded_size - offset : 0;
+
+		if (size > unit) {
+			size = unit;
+		}
+		if (size > 0 && resume && page_is_done(&journal, offset)) {
+			board->skipped += size;
+			size = 0;
+		}
+		if (size > 0 && pending == 0) {
+			start = offset;
+		}
+		pending += size;
+		if (pending > 0 && (size == 0 || pending >= FLASH_CHUNK_SIZE)) {
+			if (msc_device_flash_write(dev, start, image + start,
+						   pending) < 0) {
+				return fail(board, "flash write");
+			}
+			pending = 0;
+		}
+	}
+	if (msc_device_flash_crc(dev, 0, padded_size, &crc) < 0) {
+		return fail(board, "flash crc");
+	}
+	if (crc != msc_crc32(image, padded_size)) {
+		errno = EIO;
+		return fail(board, "verify");
+	}
+	if (!no_reboot && msc_device_reboot(dev) < 0) {
+		return fail(board, "reboot");
+	}
+	return 0;
+}
+
+static void *board_thread(void *arg)
+{
+	struct board *board = arg;
+	double start = msc_now();
+
+	if (msc_device_open(&board->dev, board->dev.path,
+			    mode == MODE_BLOCK) < 0) {
+		fail(board, "open");
+	} else {
+		if (mode == MODE_BLOCK) {
+			flash_block(board);
+		} else {
+			flash_direct(board);
+		}
+		msc_device_close(&board->dev);
+	}
+	board->seconds = msc_now() - start;
+	return NULL;
+}
+
+static int load_image(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	struct stat st;
+
+	if (file == NULL || fstat(fileno(file), &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	image_size = st.st_size;
+	padded_size = (image_size + MSC_DEVICE_BLOCK_SIZE - 1) &
+		~(MSC_DEVICE_BLOCK_SIZE - 1);
+	image = msc_device_alloc(padded_size ? padded_size : 1);
+	if (image == NULL) {
+		fclose(file);
+		return -1;
+	}
+	memset(image + image_size, 0xFF, padded_size - image_size);
+	if (fread(image, 1, image_size, file) != image_size) {
+		perror(path);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	image_crc = msc_crc32(image, padded_size);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-m block|flash] [-S serial]... [-n] image.bin "
+		"[target...]\n"
+		"  -m block  write FIRMWARE.BIN with O_DIRECT, sync, verify "
+		"and eject (default)\n"
+		"  -m flash  use the vendor fast-flash commands, resume an "
+		"interrupted upload,\n"
+		"            verify the CRC and reboot\n"
+		"  -S serial only flash the boards with this USB serial "
+		"number\n"
+		"  -n        do not eject or reboot the boards\n"
+		"Targets are block devices or volume image files, all the "
+		"bootloader drives\nfound when none is given.\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct board boards[MAX_BOARDS];
+	const char *serials[MAX_SERIALS];
+	int serial_count = 0;
+	int count = 0, failed = 0;
+	double start, seconds;
+	int option, i;
+
+	while ((option = getopt(argc, argv, "m:S:nh")) != -1) {
+		switch (option) {
+		case 'm':
+			if (strcmp(optarg, "block") == 0) {
+				mode = MODE_BLOCK;
+			} else if (strcmp(optarg, "flash") == 0) {
+				mode = MODE_FLASH;
+			} else {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+
+		case 'S':
+			if (serial_count < MAX_SERIALS) {
+				serials[serial_count++] = optarg;
+			}
+			break;
+
+		case 'n':
+			no_reboot = true;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (load_image(argv[optind++]) < 0) {
+		return 1;
+	}
+
+	if (optind < argc) {
+		for (; optind < argc && count < MAX_BOARDS; optind++) {
+			snprintf(boards[count].dev.path,
+				 sizeof (boards[count].dev.path), "%s",
+				 argv[optind]);
+			snprintf(boards[count].dev.serial,
+				 sizeof (boards[count].dev.serial), "-");
+			count++;
+		}
+	} else {
+		struct msc_device found[MAX_BOARDS];
+		int n = msc_device_scan(found, MAX_BOARDS);
+
+		for (i = 0; i < n; i++) {
+			int j;
+
+			for (j = 0; j < serial_count; j++) {
+				if (strcmp(found[i].serial, serials[j]) == 0) {
+					break;
+				}
+			}
+			if (serial_count == 0 || j < serial_count) {
+				boards[count++].dev = found[i];
+			}
+		}
+	}
+	if (count == 0) {
+		fprintf(stderr, "No bootloader drive found\n");
+		return 1;
+	}
+
+	start = msc_now();
+	for (i = 0; i < count; i++) {
+		boards[i].dev.fd = -1;
+		if (pthread_create(&boards[i].thread, NULL, board_thread,
+				   &boards[i]) != 0) {
+			boards[i].error = "thread";
+			boards[i].thread = 0;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		if (boards[i].thread != 0) {
+			pthread_join(boards[i].thread, NULL);
+		}
+	}
+	seconds = msc_now() - start;
+
+	printf("%-24s %-16s %10s %8s %10s  %s\n",
+	       "SERIAL", "TARGET", "BYTES", "SECONDS", "KB/S", "STATUS");
+	for (i = 0; i < count; i++) {
+		struct board *board = &boards[i];
+
+		printf("%-24s %-16s %10u %8.3f %10.1f  ",
+		       board->dev.serial, board->dev.path, image_size,
+		       board->seconds,
+		       board->seconds > 0 ?
+		       image_size / 1024.0 / board->seconds : 0.0);
+		if (board->error != NULL) {
+			printf("FAILED: %s: %s\n", board->error,
+			       strerror(board->error_number));
+			failed++;
+		} else if (board->skipped > 0) {
+			printf("OK, resumed, %u bytes skipped\n",
+			       board->skipped);
+		} else {
+			printf("OK\n");
+		}
+	}
+	printf("%d board(s), %d failed, %.3f s, aggregate %.1f KB/s\n",
+	       count, failed, seconds,
+	       seconds > 0 ?
+	       (double) (count - failed) * image_size / 1024.0 / seconds :
+	       0.0);
+	return failed ? 1 : 0;
+}
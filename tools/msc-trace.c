@@ -0,0 +1,318 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Convert the TRACE.BIN event log of a bootloader built with USE_TRACE to
+ * the Chrome trace event JSON format, to be loaded in chrome://tracing or
+ * Perfetto. SCSI commands are shown from their CBW to their CSW, with
+ * their flash operations and the periods the host is NAKed on the
+ * following rows, and the USB packets as instant events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* TRACE.BIN layout, see inc/trace.h */
+#define TRACE_MAGIC             0x45435254      /* "TRCE" */
+#define TRACE_VERSION           1
+#define TRACE_HEADER_SIZE       16
+#define TRACE_ENTRY_SIZE        16
+#define TRACE_MAX_SIZE          (1024 * 1024)
+
+enum trace_event {
+	TRACE_USB_OUT = 1,
+	TRACE_USB_IN,
+	TRACE_CBW,
+	TRACE_CSW,
+	TRACE_SCSI,
+	TRACE_ERASE_BEGIN,
+	TRACE_ERASE_END,
+	TRACE_PROGRAM_BEGIN,
+	TRACE_PROGRAM_END,
+	TRACE_NAK_BEGIN,
+	TRACE_NAK_END,
+};
+
+/* Timeline rows */
+enum row {
+	ROW_SCSI = 1,
+	ROW_FLASH,
+	ROW_NAK,
+	ROW_USB,
+};
+
+static const char *const row_names[] = {
+	[ROW_SCSI] = "SCSI",
+	[ROW_FLASH] = "Flash",
+	[ROW_NAK] = "NAK",
+	[ROW_USB] = "USB",
+};
+
+struct entry {
+	double time;
+	uint8_t event;
+	uint16_t arg;
+	uint32_t a;
+	uint32_t b;
+};
+
+static const struct {
+	uint8_t opcode;
+	const char *name;
+} scsi_commands[] = {
+	{ 0x00, "TEST UNIT READY" },
+	{ 0x03, "REQUEST SENSE" },
+	{ 0x12, "INQUIRY" },
+	{ 0x1A, "MODE SENSE(6)" },
+	{ 0x1B, "START STOP UNIT" },
+	{ 0x1E, "PREVENT ALLOW MEDIUM REMOVAL" },
+	{ 0x23, "READ FORMAT CAPACITIES" },
+	{ 0x25, "READ CAPACITY(10)" },
+	{ 0x28, "READ(10)" },
+	{ 0x2A, "WRITE(10)" },
+	{ 0x2F, "VERIFY(10)" },
+	{ 0x35, "SYNCHRONIZE CACHE(10)" },
+	{ 0x42, "UNMAP" },
+	{ 0x5A, "MODE SENSE(10)" },
+	{ 0x9E, "SERVICE ACTION IN(16)" },
+	{ 0xC0, "FLASH WRITE" },
+	{ 0xC1, "FLASH ERASE" },
+	{ 0xC2, "FLASH CRC" },
+	{ 0xC3, "FLASH INFO" },
+	{ 0xC4, "REBOOT" },
+	{ 0xC5, "FLASH JOURNAL" },
+	{ 0xC6, "BUFFER STATS" },
+	{ 0xC7, "PIPELINE STATS" },
+};
+
+static bool first_event = true;
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static const char *scsi_name(uint8_t opcode)
+{
+	static char name[16];
+	size_t i;
+
+	for (i = 0; i < sizeof (scsi_commands) / sizeof (scsi_commands[0]);
+	     i++) {
+		if (scsi_commands[i].opcode == opcode) {
+			return scsi_commands[i].name;
+		}
+	}
+	snprintf(name, sizeof (name), "SCSI 0x%02X", opcode);
+	return name;
+}
+
+/* Start an event object, the caller adding its arguments and closing it */
+static void event_begin(const char *phase, const char *name, enum row row,
+			double time)
+{
+	printf("%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+	       "\"ts\":%.3f", first_event ? "" : ",", phase, name, row, time);
+	first_event = false;
+}
+
+static void complete_event(const char *name, enum row row,
+			   const struct entry *begin, const struct entry *end)
+{
+	event_begin("X", name, row, begin->time);
+	printf(",\"dur\":%.3f", end->time - begin->time);
+}
+
+static void convert(const struct entry *entries, uint32_t count)
+{
+	const struct entry *cbw = NULL, *scsi = NULL;
+	const struct entry *erase = NULL, *program = NULL, *nak = NULL;
+	uint32_t i;
+	int row;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (row = ROW_SCSI; row <= ROW_USB; row++) {
+		printf("%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,"
+		       "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		       first_event ? "" : ",", row, row_names[row]);
+		first_event = false;
+	}
+
+	/* Events whose beginning has been overwritten in the ring buffer
+	 * are dropped
+	 */
+	for (i = 0; i < count; i++) {
+		const struct entry *e = &entries[i];
+
+		switch (e->event) {
+		case TRACE_USB_OUT:
+		case TRACE_USB_IN:
+			event_begin("i", e->event == TRACE_USB_OUT ?
+				    "OUT" : "IN", ROW_USB, e->time);
+			printf(",\"s\":\"t\",\"args\":{\"ep\":\"0x%02X\","
+			       "\"length\":%u}}", e->arg, e->a);
+			break;
+
+		case TRACE_CBW:
+			cbw = e;
+			scsi = NULL;
+			break;
+
+		case TRACE_SCSI:
+			scsi = cbw != NULL ? e : NULL;
+			break;
+
+		case TRACE_CSW:
+			if (cbw == NULL || scsi == NULL || cbw->a != e->a) {
+				break;
+			}
+			complete_event(scsi_name(scsi->arg), ROW_SCSI, cbw, e);
+			printf(",\"args\":{\"tag\":%u,\"lun\":%u,"
+			       "\"length\":%u,\"lba\":%u,\"blocks\":%u,"
+			       "\"status\":%u,\"residue\":%u}}",
+			       cbw->a, cbw->arg, cbw->b, scsi->a, scsi->b,
+			       e->arg, e->b);
+			cbw = NULL;
+			scsi = NULL;
+			break;
+
+		case TRACE_ERASE_BEGIN:
+			erase = e;
+			break;
+
+		case TRACE_PROGRAM_BEGIN:
+			program = e;
+			break;
+
+		case TRACE_NAK_BEGIN:
+			nak = e;
+			break;
+
+		case TRACE_ERASE_END:
+		case TRACE_PROGRAM_END:
+		case TRACE_NAK_END: {
+			const struct entry **begin =
+				e->event == TRACE_ERASE_END ? &erase :
+				e->event == TRACE_PROGRAM_END ? &program : &nak;
+
+			if (*begin == NULL || (*begin)->a != e->a) {
+				break;
+			}
+			if (e->event == TRACE_NAK_END) {
+				complete_event(e->arg & 0x80 ? "NAK IN" :
+					       "NAK OUT", ROW_NAK, *begin, e);
+				printf(",\"args\":{\"lba\":%u}}", e->a);
+			} else {
+				complete_event(e->event == TRACE_ERASE_END ?
+					       "erase" : "program", ROW_FLASH,
+					       *begin, e);
+				printf(",\"args\":{\"address\":\"0x%08X\"}}",
+				       e->a);
+			}
+			*begin = NULL;
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+	printf("\n]}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	uint8_t *trace;
+	struct entry *entries;
+	uint32_t size, capacity, total, count, first, i;
+	uint64_t cycles = 0;
+	uint32_t clock_hz, previous = 0;
+
+	if (argc > 2 || (argc > 1 && strcmp(argv[1], "-h") == 0)) {
+		fprintf(stderr, "Usage: %s [TRACE.BIN] > trace.json\n",
+			argv[0]);
+		return 2;
+	}
+	if (file == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	trace = malloc(TRACE_MAX_SIZE);
+	if (trace == NULL) {
+		return 1;
+	}
+	size = fread(trace, 1, TRACE_MAX_SIZE, file);
+	if (size < TRACE_HEADER_SIZE ||
+	    get_le32(trace) != TRACE_MAGIC ||
+	    get_le16(trace + 4) != TRACE_VERSION ||
+	    get_le16(trace + 6) != TRACE_ENTRY_SIZE) {
+		fprintf(stderr, "Not a version %d trace file\n",
+			TRACE_VERSION);
+		return 1;
+	}
+	clock_hz = get_le32(trace + 8);
+	total = get_le32(trace + 12);
+	capacity = (size - TRACE_HEADER_SIZE) / TRACE_ENTRY_SIZE;
+	if (clock_hz == 0 || capacity == 0) {
+		fprintf(stderr, "Invalid trace file header\n");
+		return 1;
+	}
+
+	/* Once the ring buffer has wrapped, the oldest entry is the next
+	 * one to be overwritten
+	 */
+	count = total < capacity ? total : capacity;
+	first = total < capacity ? 0 : total % capacity;
+	entries = calloc(count ? count : 1, sizeof (*entries));
+	if (entries == NULL) {
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		const uint8_t *p = trace + TRACE_HEADER_SIZE +
+			(first + i) % capacity * TRACE_ENTRY_SIZE;
+		uint32_t time = get_le32(p);
+
+		/* The 32-bit cycle counter wraps around, the time between
+		 * two events is assumed to be shorter than that
+		 */
+		if (i > 0) {
+			cycles += (uint32_t) (time - previous);
+		}
+		previous = time;
+		entries[i].time = cycles * 1e6 / clock_hz;
+		entries[i].event = p[4];
+		entries[i].arg = get_le16(p + 6);
+		entries[i].a = get_le32(p + 8);
+		entries[i].b = get_le32(p + 12);
+	}
+	convert(entries, count);
+	fprintf(stderr, "%u events, %u lost\n", count, total - count);
+	free(entries);
+	free(trace);
+	return 0;
+}
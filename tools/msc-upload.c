@@ -0,0 +1,359 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Upload an image to a bootloader drive and time it: the image is written
+ * into the preallocated firmware file with O_DIRECT, in flash page aligned
+ * writes of the optimal transfer size, then the drive cache is synchronized
+ * and the drive is ejected. The throughput, the write latency percentiles,
+ * the bootloader RAM buffer usage and, if profiled, the CPU cycles per byte
+ * of each write path stage are reported. A volume image file or a loop
+ * device can be used as the target for testing. Optionally, the first
+ * pages are written and erased again before the upload, to check that the
+ * page slots dropped by the erase give their buffers back to the pool.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "msc_device.h"
+
+/* Writes are aligned on, and sized in multiples of, the flash page */
+#define FLASH_PAGE_SIZE         1024
+
+/* Write size when the drive does not report an optimal one */
+#define DEFAULT_WRITE_SIZE      4096
+
+#define MAX_WRITE_SIZE          (1024 * 1024)
+
+/* Write path stages, in the bootloader order */
+static const char *const pipeline_stages[] = {
+	"receive", "fat", "program", "spi nor",
+};
+
+/* Buffer pool owners, in the bootloader order */
+#define BUFFER_PAGE_SLOT        2
+
+static const char *const buffer_owners[] = {
+	"free", "USB", "page slots", "staging", "SPI NOR",
+};
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const double *samples, int count, int percent)
+{
+	int rank = (count * percent + 99) / 100;
+
+	return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static uint8_t *load_image(const char *path, uint32_t *size,
+			   uint32_t *padded_size)
+{
+	FILE *file = fopen(path, "rb");
+	struct stat st;
+	uint8_t *image;
+
+	if (file == NULL || fstat(fileno(file), &st) < 0) {
+		perror(path);
+		return NULL;
+	}
+	*size = st.st_size;
+
+	/* Padded to whole blocks with erased bytes, as needed by O_DIRECT */
+	*padded_size = (*size + MSC_DEVICE_BLOCK_SIZE - 1) &
+		~(MSC_DEVICE_BLOCK_SIZE - 1);
+	image = msc_device_alloc(*padded_size ? *padded_size : 1);
+	if (image == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	memset(image + *size, 0xFF, *padded_size - *size);
+	if (fread(image, 1, *size, file) != *size) {
+		perror(path);
+		fclose(file);
+		free(image);
+		return NULL;
+	}
+	fclose(file);
+	return image;
+}
+
+static void print_buffer_stats(const struct msc_buffer_stats *stats)
+{
+	uint32_t i;
+
+	printf("Buffers   %u x %u bytes, %u in use, peak %u (%u bytes), "
+	       "%u failed\n", stats->count, stats->buffer_size,
+	       stats->in_use, stats->high_water,
+	       stats->high_water * stats->buffer_size, stats->failures);
+	for (i = 1; i < stats->owners; i++) {
+		if (stats->owned_high_water[i] == 0) {
+			continue;
+		}
+		if (i < sizeof (buffer_owners) / sizeof (buffer_owners[0])) {
+			printf("          %-10s", buffer_owners[i]);
+		} else {
+			printf("          owner %-4u", i);
+		}
+		printf(" %u in use, peak %u\n", stats->owned[i],
+		       stats->owned_high_water[i]);
+	}
+}
+
+/* Cycles per byte of each stage during the upload */
+static void print_pipeline_stats(const struct msc_pipeline_stats *before,
+				 const struct msc_pipeline_stats *after)
+{
+	uint32_t i;
+
+	for (i = 0; i < after->stages; i++) {
+		uint32_t bytes = after->bytes[i] - before->bytes[i];
+		uint32_t cycles = after->cycles[i] - before->cycles[i];
+
+		if (bytes == 0) {
+			continue;
+		}
+		printf(i == 0 ? "Stages    " : "          ");
+		if (i < sizeof (pipeline_stages) / sizeof (pipeline_stages[0])) {
+			printf("%-10s", pipeline_stages[i]);
+		} else {
+			printf("stage %-4u", i);
+		}
+		printf(" %8u bytes, %6.2f cycles/byte\n", bytes,
+		       (double) cycles / bytes);
+	}
+}
+
+/*
+ * Write the first pages of the image, which stay cached in the page slots,
+ * then erase them: the dropped slots must not keep any pool buffer.
+ */
+static int check_unmap(struct msc_device *dev, const uint8_t *image,
+		       uint32_t size)
+{
+	struct msc_buffer_stats stats;
+
+	if (pwrite(dev->fd, image, size, dev->firmware_offset) !=
+	    (ssize_t) size) {
+		fprintf(stderr, "%s: write: %s\n", dev->path, strerror(errno));
+		return -1;
+	}
+	if (msc_device_flash_erase(dev, 0, size) < 0 ||
+	    msc_device_buffer_stats(dev, &stats) < 0) {
+		fprintf(stderr, "%s: erase check: %s\n", dev->path,
+			strerror(errno));
+		return -1;
+	}
+	if (stats.owners > BUFFER_PAGE_SLOT &&
+	    stats.owned[BUFFER_PAGE_SLOT] != 0) {
+		fprintf(stderr, "%s: %u page slot buffers leaked by the "
+			"erase\n", dev->path, stats.owned[BUFFER_PAGE_SLOT]);
+		return -1;
+	}
+	printf("Unmap     page slot buffers released\n");
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-b bytes] [-n] [-u] image.bin [target]\n"
+		"  -b bytes  write size, a multiple of %d (default: the "
+		"drive optimal size)\n"
+		"  -n        do not eject the drive\n"
+		"  -u        first check that erasing cached pages releases "
+		"their buffers\n"
+		"The target is a block device, a loop device or a volume "
+		"image file, the only\nbootloader drive found when none is "
+		"given.\n", name, FLASH_PAGE_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct msc_device dev;
+	struct msc_buffer_stats stats;
+	struct msc_pipeline_stats profile_start, profile_end;
+	uint32_t write_size = 0, image_size, padded_size, offset;
+	bool no_eject = false, unmap = false;
+	uint8_t *image;
+	double *latencies;
+	double start, write_end, sync_end, end;
+	int writes = 0, option;
+	bool has_stats, has_profile;
+
+	while ((option = getopt(argc, argv, "b:nuh")) != -1) {
+		switch (option) {
+		case 'b':
+			write_size = strtoul(optarg, NULL, 0);
+			if (write_size == 0 || write_size > MAX_WRITE_SIZE ||
+			    write_size % FLASH_PAGE_SIZE != 0) {
+				usage(argv[0]);
+				return 2;
+			}
+			break;
+
+		case 'n':
+			no_eject = true;
+			break;
+
+		case 'u':
+			unmap = true;
+			break;
+
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc || argc - optind > 2) {
+		usage(argv[0]);
+		return 2;
+	}
+	image = load_image(argv[optind++], &image_size, &padded_size);
+	if (image == NULL) {
+		return 1;
+	}
+
+	memset(&dev, 0, sizeof (dev));
+	if (optind < argc) {
+		snprintf(dev.path, sizeof (dev.path), "%s", argv[optind]);
+	} else if (msc_device_scan(&dev, 1) != 1) {
+		fprintf(stderr, "No bootloader drive found\n");
+		return 1;
+	}
+	if (msc_device_open(&dev, dev.path, true) < 0) {
+		perror(dev.path);
+		return 1;
+	}
+	if (msc_device_locate_firmware(&dev) < 0) {
+		fprintf(stderr, "%s: no firmware file: %s\n", dev.path,
+			strerror(errno));
+		return 1;
+	}
+	if (padded_size > dev.firmware_size) {
+		fprintf(stderr, "%s: image larger than the firmware file "
+			"(%u bytes)\n", dev.path, dev.firmware_size);
+		return 1;
+	}
+
+	/* Optimal size, rounded down to whole flash pages */
+	if (write_size == 0) {
+		write_size = msc_device_optimal_io_size(&dev);
+		if (write_size > MAX_WRITE_SIZE) {
+			write_size = MAX_WRITE_SIZE;
+		}
+		write_size -= write_size % FLASH_PAGE_SIZE;
+		if (write_size == 0) {
+			write_size = DEFAULT_WRITE_SIZE;
+		}
+	}
+	latencies = calloc(padded_size / FLASH_PAGE_SIZE + 1,
+			   sizeof (*latencies));
+	if (latencies == NULL) {
+		return 1;
+	}
+
+	if (unmap && dev.is_scsi &&
+	    check_unmap(&dev, image, write_size < padded_size ?
+			write_size : padded_size) < 0) {
+		return 1;
+	}
+	has_profile = dev.is_scsi &&
+		msc_device_pipeline_stats(&dev, &profile_start) == 0;
+	start = msc_now();
+	for (offset = 0; offset < padded_size; offset += write_size) {
+		uint32_t size = padded_size - offset;
+		double begin;
+
+		if (size > write_size) {
+			size = write_size;
+		}
+		begin = msc_now();
+		if (pwrite(dev.fd, image + offset, size,
+			   dev.firmware_offset + offset) != (ssize_t) size) {
+			fprintf(stderr, "%s: write at %u: %s\n", dev.path,
+				offset, strerror(errno));
+			return 1;
+		}
+		latencies[writes++] = msc_now() - begin;
+	}
+	write_end = msc_now();
+	if (msc_device_sync(&dev) < 0) {
+		fprintf(stderr, "%s: synchronize cache: %s\n", dev.path,
+			strerror(errno));
+		return 1;
+	}
+	sync_end = msc_now();
+
+	/* Read before the eject, which restarts the bootloader */
+	has_stats = dev.is_scsi && msc_device_buffer_stats(&dev, &stats) == 0;
+	has_profile = has_profile &&
+		msc_device_pipeline_stats(&dev, &profile_end) == 0;
+	if (!no_eject && msc_device_eject(&dev) < 0) {
+		fprintf(stderr, "%s: eject: %s\n", dev.path, strerror(errno));
+		return 1;
+	}
+	end = msc_now();
+	msc_device_close(&dev);
+
+	printf("Target    %s%s%s\n", dev.path,
+	       dev.direct ? ", O_DIRECT" : "",
+	       dev.is_scsi ? ", SCSI" : "");
+	printf("Image     %u bytes, %d writes of %u bytes\n",
+	       image_size, writes, write_size);
+	printf("Write     %8.3f s\n", write_end - start);
+	printf("Sync      %8.3f s\n", sync_end - write_end);
+	if (!no_eject) {
+		printf("Eject     %8.3f s\n", end - sync_end);
+	}
+	printf("Total     %8.3f s, %.1f KB/s\n", end - start,
+	       end > start ? image_size / 1024.0 / (end - start) : 0.0);
+	if (writes > 0) {
+		qsort(latencies, writes, sizeof (*latencies), compare_double);
+		printf("Latency   min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  "
+		       "max %.3f ms\n",
+		       latencies[0] * 1e3,
+		       percentile(latencies, writes, 50) * 1e3,
+		       percentile(latencies, writes, 90) * 1e3,
+		       percentile(latencies, writes, 99) * 1e3,
+		       latencies[writes - 1] * 1e3);
+	}
+	if (has_profile) {
+		print_pipeline_stats(&profile_start, &profile_end);
+	}
+	if (has_stats) {
+		print_buffer_stats(&stats);
+	}
+	free(latencies);
+	free(image);
+	return 0;
+}
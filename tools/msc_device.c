@@ -0,0 +1,542 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <scsi/sg.h>
+#include "msc_device.h"
+
+/* SCSI commands */
+#define SCSI_INQUIRY            0x12
+#define SCSI_START_STOP_UNIT    0x1B
+#define SCSI_SYNCHRONIZE_CACHE  0x35
+
+/* SCSI pass-through timeout, long enough for a flush of the whole cache */
+#define SCSI_TIMEOUT_MS         20000
+
+/* Block Limits VPD page */
+#define SCSI_VPD_BLOCK_LIMITS   0xB0
+#define SCSI_VPD_BLOCK_LIMITS_LENGTH 64
+
+/* --- Helpers ------------------------------------------------------------- */
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/* Read a sysfs attribute, without its trailing spaces and newline */
+static int read_attribute(const char *path, char *value, size_t size)
+{
+	FILE *file = fopen(path, "r");
+	size_t length;
+
+	if (file == NULL) {
+		return -1;
+	}
+	if (fgets(value, size, file) == NULL) {
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	length = strlen(value);
+	while (length > 0 && (value[length - 1] == '\n' ||
+			      value[length - 1] == ' ')) {
+		value[--length] = '\0';
+	}
+	return 0;
+}
+
+double msc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * CRC-32/MPEG-2 over little-endian 32-bit words, the same as the STM32 CRC
+ * unit.
+ */
+uint32_t msc_crc32(const uint8_t *data, uint32_t length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	uint32_t i;
+	int bit;
+
+	for (i = 0; i + 4 <= length; i += 4) {
+		crc ^= get_le32(data + i);
+		for (bit = 0; bit < 32; bit++) {
+			crc = (crc & 0x80000000) ?
+				(crc << 1) ^ 0x04C11DB7 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/* Buffers suitable for O_DIRECT transfers */
+void *msc_device_alloc(size_t size)
+{
+	void *buffer;
+
+	if (posix_memalign(&buffer, 4096, size) != 0) {
+		return NULL;
+	}
+	memset(buffer, 0, size);
+	return buffer;
+}
+
+/* --- Discovery ----------------------------------------------------------- */
+
+/*
+ * Find the bootloader drives: SCSI disks whose INQUIRY vendor is the
+ * bootloader one, along with the serial number of their USB device, found
+ * by walking up the sysfs device path.
+ */
+int msc_device_scan(struct msc_device *devices, int max)
+{
+	DIR *dir = opendir("/sys/block");
+	struct dirent *entry;
+	int count = 0;
+
+	if (dir == NULL) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL && count < max) {
+		char path[PATH_MAX + 16];
+		char real[PATH_MAX];
+		char value[64];
+		char *p;
+
+		if (strncmp(entry->d_name, "sd", 2) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof (path), "/sys/block/%s/device/vendor",
+			 entry->d_name);
+		if (read_attribute(path, value, sizeof (value)) < 0 ||
+		    strcmp(value, MSC_DEVICE_VENDOR) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof (path), "/sys/block/%s/device",
+			 entry->d_name);
+		if (realpath(path, real) == NULL) {
+			continue;
+		}
+		value[0] = '\0';
+		while ((p = strrchr(real, '/')) != NULL && p != real) {
+			*p = '\0';
+			snprintf(path, sizeof (path), "%s/serial", real);
+			if (read_attribute(path, value, sizeof (value)) == 0) {
+				break;
+			}
+		}
+		memset(&devices[count], 0, sizeof (devices[count]));
+		snprintf(devices[count].path, sizeof (devices[count].path),
+			 "/dev/%.200s", entry->d_name);
+		snprintf(devices[count].serial,
+			 sizeof (devices[count].serial), "%s", value);
+		devices[count].fd = -1;
+		count++;
+	}
+	closedir(dir);
+	return count;
+}
+
+/* --- Block Access -------------------------------------------------------- */
+
+/*
+ * Open a drive, or a volume image file. O_DIRECT is dropped when the file
+ * system holding an image file does not support it.
+ */
+int msc_device_open(struct msc_device *dev, const char *path, bool direct)
+{
+	struct stat st;
+	int flags = O_RDWR | O_CLOEXEC;
+	int version;
+
+	if (path != dev->path) {
+		snprintf(dev->path, sizeof (dev->path), "%s", path);
+	}
+	dev->direct = direct;
+	dev->fd = open(path, flags | (direct ? O_DIRECT : 0));
+	if (dev->fd < 0 && direct && errno == EINVAL) {
+		dev->direct = false;
+		dev->fd = open(path, flags);
+	}
+	if (dev->fd < 0) {
+		return -1;
+	}
+	if (fstat(dev->fd, &st) < 0) {
+		close(dev->fd);
+		dev->fd = -1;
+		return -1;
+	}
+	dev->is_block = S_ISBLK(st.st_mode);
+	dev->is_scsi = dev->is_block && ioctl(dev->fd, SG_GET_VERSION_NUM,
+					      &version) == 0;
+	dev->rdev = st.st_rdev;
+	return 0;
+}
+
+void msc_device_close(struct msc_device *dev)
+{
+	if (dev->fd >= 0) {
+		close(dev->fd);
+		dev->fd = -1;
+	}
+}
+
+/*
+ * Find the firmware file data in the FAT volume, from the BPB and the root
+ * directory. The bootloader allocates it as a single contiguous chain.
+ */
+int msc_device_locate_firmware(struct msc_device *dev)
+{
+	uint8_t *sector = msc_device_alloc(MSC_DEVICE_BLOCK_SIZE);
+	uint32_t bytes_per_sector, sectors_per_cluster, root_start;
+	uint32_t root_sectors, entries, i;
+	int status = -1;
+
+	if (sector == NULL) {
+		return -1;
+	}
+	if (pread(dev->fd, sector, MSC_DEVICE_BLOCK_SIZE, 0) !=
+	    MSC_DEVICE_BLOCK_SIZE) {
+		goto out;
+	}
+	bytes_per_sector = get_le16(sector + 11);
+	sectors_per_cluster = sector[13];
+	root_start = get_le16(sector + 14) + sector[16] * get_le16(sector + 22);
+	entries = get_le16(sector + 17);
+	if (bytes_per_sector != MSC_DEVICE_BLOCK_SIZE ||
+	    sectors_per_cluster == 0 || entries == 0) {
+		errno = EINVAL;
+		goto out;
+	}
+	root_sectors = (entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+
+	for (i = 0; i < entries; i++) {
+		const uint8_t *entry = sector + (i % 16) * 32;
+		uint32_t cluster;
+
+		if (i % 16 == 0 &&
+		    pread(dev->fd, sector, MSC_DEVICE_BLOCK_SIZE,
+			  (uint64_t) (root_start + i / 16) *
+			  bytes_per_sector) != MSC_DEVICE_BLOCK_SIZE) {
+			goto out;
+		}
+		if (entry[0] == 0x00) {
+			break;
+		}
+		if (memcmp(entry, "FIRMWAREBIN", 11) != 0 &&
+		    memcmp(entry, "FIRMWARETXT", 11) != 0) {
+			continue;
+		}
+		cluster = get_le16(entry + 26);
+		dev->firmware_offset = ((uint64_t) root_start + root_sectors +
+					(uint64_t) (cluster - 2) *
+					sectors_per_cluster) *
+			bytes_per_sector;
+		dev->firmware_size = get_le32(entry + 28);
+		status = 0;
+		goto out;
+	}
+	errno = ENOENT;
+out:
+	free(sector);
+	return status;
+}
+
+/*
+ * Optimal write size, in bytes: the optimal transfer length of the Block
+ * Limits VPD page, or the kernel queue limit for the block devices without
+ * SCSI pass-through, 0 if unknown.
+ */
+uint32_t msc_device_optimal_io_size(struct msc_device *dev)
+{
+	uint8_t cdb[6] = { SCSI_INQUIRY, 0x01, SCSI_VPD_BLOCK_LIMITS, 0,
+			   SCSI_VPD_BLOCK_LIMITS_LENGTH };
+	uint8_t *page;
+	char path[64];
+	char value[32];
+	uint32_t size = 0;
+
+	if (dev->is_scsi) {
+		page = msc_device_alloc(SCSI_VPD_BLOCK_LIMITS_LENGTH);
+		if (page != NULL &&
+		    msc_device_scsi(dev, cdb, sizeof (cdb), true, page,
+				    SCSI_VPD_BLOCK_LIMITS_LENGTH) == 0 &&
+		    page[1] == SCSI_VPD_BLOCK_LIMITS) {
+			size = get_be32(page + 12) * MSC_DEVICE_BLOCK_SIZE;
+		}
+		free(page);
+	}
+	if (size == 0 && dev->is_block) {
+		snprintf(path, sizeof (path),
+			 "/sys/dev/block/%u:%u/queue/optimal_io_size",
+			 major(dev->rdev), minor(dev->rdev));
+		if (read_attribute(path, value, sizeof (value)) == 0) {
+			size = strtoul(value, NULL, 10);
+		}
+	}
+	return size;
+}
+
+/* --- SCSI Pass-Through --------------------------------------------------- */
+
+int msc_device_scsi(struct msc_device *dev,
+		    const uint8_t *cdb, int cdb_length,
+		    bool data_in, void *data, uint32_t length)
+{
+	struct sg_io_hdr io;
+	uint8_t sense[32];
+
+	if (!dev->is_scsi) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	memset(&io, 0, sizeof (io));
+	io.interface_id = 'S';
+	io.cmdp = (unsigned char *) cdb;
+	io.cmd_len = cdb_length;
+	io.dxferp = data;
+	io.dxfer_len = length;
+	io.dxfer_direction = length == 0 ? SG_DXFER_NONE :
+		data_in ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+	io.sbp = sense;
+	io.mx_sb_len = sizeof (sense);
+	io.timeout = SCSI_TIMEOUT_MS;
+	if (ioctl(dev->fd, SG_IO, &io) < 0) {
+		return -1;
+	}
+	if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Write back the drive cache, or the page cache for an image file */
+int msc_device_sync(struct msc_device *dev)
+{
+	uint8_t cdb[10] = { SCSI_SYNCHRONIZE_CACHE };
+
+	if (fsync(dev->fd) < 0 && errno != EINVAL) {
+		return -1;
+	}
+	if (!dev->is_scsi) {
+		return 0;
+	}
+	return msc_device_scsi(dev, cdb, sizeof (cdb), false, NULL, 0);
+}
+
+/* Eject the medium, which commits the update and starts the application */
+int msc_device_eject(struct msc_device *dev)
+{
+	uint8_t cdb[6] = { SCSI_START_STOP_UNIT, 0, 0, 0, 0x02 };
+
+	if (!dev->is_scsi) {
+		return 0;
+	}
+	return msc_device_scsi(dev, cdb, sizeof (cdb), false, NULL, 0);
+}
+
+static void flash_cdb(uint8_t *cdb, uint8_t opcode,
+		      uint32_t offset, uint32_t length)
+{
+	memset(cdb, 0, 10);
+	cdb[0] = opcode;
+	put_be32(cdb + 2, offset);
+	put_be32(cdb + 6, length);
+}
+
+int msc_device_flash_write(struct msc_device *dev, uint32_t offset,
+			   const void *data, uint32_t length)
+{
+	uint8_t cdb[10];
+
+	flash_cdb(cdb, MSC_FLASH_WRITE, offset, length);
+	return msc_device_scsi(dev, cdb, sizeof (cdb), false,
+			       (void *) data, length);
+}
+
+int msc_device_flash_erase(struct msc_device *dev, uint32_t offset,
+			   uint32_t length)
+{
+	uint8_t cdb[10];
+
+	flash_cdb(cdb, MSC_FLASH_ERASE, offset, length);
+	return msc_device_scsi(dev, cdb, sizeof (cdb), false, NULL, 0);
+}
+
+int msc_device_flash_crc(struct msc_device *dev, uint32_t offset,
+			 uint32_t length, uint32_t *crc)
+{
+	uint8_t cdb[10];
+	uint8_t response[4];
+
+	flash_cdb(cdb, MSC_FLASH_CRC, offset, length);
+	if (msc_device_scsi(dev, cdb, sizeof (cdb), true, response,
+			    sizeof (response)) < 0) {
+		return -1;
+	}
+	*crc = ((uint32_t) response[0] << 24) | (response[1] << 16) |
+		(response[2] << 8) | response[3];
+	return 0;
+}
+
+int msc_device_reboot(struct msc_device *dev)
+{
+	uint8_t cdb[10];
+
+	flash_cdb(cdb, MSC_REBOOT, 0, 0);
+	return msc_device_scsi(dev, cdb, sizeof (cdb), false, NULL, 0);
+}
+
+/*
+ * Open the progress journal of an upload identified by key (the image CRC),
+ * getting the CRCs of the pages already programmed if it resumes an
+ * interrupted one.
+ */
+int msc_device_flash_journal(struct msc_device *dev, uint32_t key,
+			     struct msc_journal *journal)
+{
+	uint8_t cdb[10];
+
+	memset(journal, 0, sizeof (*journal));
+	flash_cdb(cdb, MSC_FLASH_JOURNAL, key, sizeof (journal->response));
+	if (msc_device_scsi(dev, cdb, sizeof (cdb), true, journal->response,
+			    sizeof (journal->response)) < 0) {
+		return -1;
+	}
+	journal->resumed = journal->response[4] != 0;
+	journal->page_size = get_be32(journal->response + 8);
+	journal->page_count = get_be32(journal->response + 12);
+	if (journal->page_size == 0 ||
+	    16 + (journal->page_count + 31) / 32 * 4 +
+	    journal->page_count * 4 > sizeof (journal->response)) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+/* Get the CRC of a page programmed during the interrupted upload */
+bool msc_journal_page(const struct msc_journal *journal, uint32_t page,
+		      uint32_t *crc)
+{
+	const uint8_t *crcs = journal->response + 16 +
+		(journal->page_count + 31) / 32 * 4;
+
+	if (!journal->resumed || page >= journal->page_count ||
+	    !(journal->response[16 + page / 8] & (1 << (page % 8)))) {
+		return false;
+	}
+	*crc = get_be32(crcs + page * 4);
+	return true;
+}
+
+int msc_device_buffer_stats(struct msc_device *dev,
+			    struct msc_buffer_stats *stats)
+{
+	uint8_t cdb[10];
+	uint8_t response[8 + MSC_BUFFER_OWNERS_MAX * 2];
+	uint32_t i;
+
+	memset(response, 0, sizeof (response));
+	flash_cdb(cdb, MSC_BUFFER_STATS, 0, sizeof (response));
+	if (msc_device_scsi(dev, cdb, sizeof (cdb), true, response,
+			    sizeof (response)) < 0) {
+		return -1;
+	}
+	memset(stats, 0, sizeof (*stats));
+	stats->buffer_size = (response[0] << 8) | response[1];
+	stats->count = response[2];
+	stats->in_use = response[3];
+	stats->high_water = response[4];
+	stats->owners = response[5];
+	stats->failures = (response[6] << 8) | response[7];
+	if (stats->buffer_size == 0 || stats->owners > MSC_BUFFER_OWNERS_MAX) {
+		errno = EPROTO;
+		return -1;
+	}
+	for (i = 0; i < stats->owners; i++) {
+		stats->owned[i] = response[8 + i * 2];
+		stats->owned_high_water[i] = response[9 + i * 2];
+	}
+	return 0;
+}
+
+/* Only available when the bootloader is built with USE_PIPELINE_PROFILE */
+int msc_device_pipeline_stats(struct msc_device *dev,
+			      struct msc_pipeline_stats *stats)
+{
+	uint8_t cdb[10];
+	uint8_t response[4 + MSC_PIPELINE_STAGES_MAX * 8];
+	uint32_t i;
+
+	memset(response, 0, sizeof (response));
+	flash_cdb(cdb, MSC_PIPELINE_STATS, 0, sizeof (response));
+	if (msc_device_scsi(dev, cdb, sizeof (cdb), true, response,
+			    sizeof (response)) < 0) {
+		return -1;
+	}
+	memset(stats, 0, sizeof (*stats));
+	stats->stages = response[0];
+	if (stats->stages > MSC_PIPELINE_STAGES_MAX) {
+		errno = EPROTO;
+		return -1;
+	}
+	for (i = 0; i < stats->stages; i++) {
+		stats->bytes[i] = get_be32(response + 4 + i * 8);
+		stats->cycles[i] = get_be32(response + 8 + i * 8);
+	}
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * This file is part of the STM32 MSC Bootloader project.
+ *
+ * Copyright (C) 2018 Michel Stempin <michel.stempin@wanadoo.fr>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host side access to the bootloader drive (Linux): device discovery by
+ * USB serial number, location of the firmware file in the FAT volume, and
+ * SCSI pass-through for the cache, eject and fast-flash commands. A
+ * regular file holding a volume image can be used instead of a device,
+ * for testing, in which case the SCSI commands are not available.
+ */
+
+#ifndef __MSC_DEVICE_H
+#define __MSC_DEVICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Vendor identification reported by the bootloader INQUIRY */
+#define MSC_DEVICE_VENDOR       "BluePill"
+
+#define MSC_DEVICE_BLOCK_SIZE   512
+
+/* Vendor specific fast-flash commands, see README.md */
+#define MSC_FLASH_WRITE         0xC0
+#define MSC_FLASH_ERASE         0xC1
+#define MSC_FLASH_CRC           0xC2
+#define MSC_FLASH_INFO          0xC3
+#define MSC_REBOOT              0xC4
+#define MSC_FLASH_JOURNAL       0xC5
+#define MSC_BUFFER_STATS        0xC6
+#define MSC_PIPELINE_STATS      0xC7
+
+/* Most buffer owners reported by the BUFFER STATS command */
+#define MSC_BUFFER_OWNERS_MAX   16
+
+/* Most stages reported by the PIPELINE STATS command */
+#define MSC_PIPELINE_STAGES_MAX 16
+
+/* Response of the PIPELINE STATS command: the bytes pushed into each write
+ * path stage and the CPU cycles spent in it since the bootloader started
+ */
+struct msc_pipeline_stats {
+	uint32_t stages;
+	uint32_t bytes[MSC_PIPELINE_STAGES_MAX];
+	uint32_t cycles[MSC_PIPELINE_STAGES_MAX];
+};
+
+/* Response of the BUFFER STATS command: the bootloader RAM buffer pool
+ * size and usage, with the buffers in use and the high-water mark of each
+ * owner
+ */
+struct msc_buffer_stats {
+	uint32_t buffer_size;
+	uint32_t count;
+	uint32_t in_use;
+	uint32_t high_water;
+	uint32_t failures;
+	uint32_t owners;
+	uint32_t owned[MSC_BUFFER_OWNERS_MAX];
+	uint32_t owned_high_water[MSC_BUFFER_OWNERS_MAX];
+};
+
+/* Response of the FLASH JOURNAL command */
+struct msc_journal {
+	uint8_t response[512];
+
+	/* The upload resumes an interrupted one with the same key */
+	bool resumed;
+
+	/* Size and count of the erase units of the flash area */
+	uint32_t page_size;
+	uint32_t page_count;
+};
+
+struct msc_device {
+	char path[256];
+	char serial[64];
+	int fd;
+
+	/* A block device, and one which accepts SCSI pass-through commands
+	 * (not a loop device)
+	 */
+	bool is_block;
+	bool is_scsi;
+	dev_t rdev;
+
+	/* Opened with O_DIRECT */
+	bool direct;
+
+	/* Firmware file data location in the volume, in bytes */
+	uint64_t firmware_offset;
+	uint32_t firmware_size;
+};
+
+extern int msc_device_scan(struct msc_device *devices, int max);
+extern int msc_device_open(struct msc_device *dev, const char *path,
+			   bool direct);
+extern void msc_device_close(struct msc_device *dev);
+extern void *msc_device_alloc(size_t size);
+extern int msc_device_locate_firmware(struct msc_device *dev);
+extern uint32_t msc_device_optimal_io_size(struct msc_device *dev);
+extern int msc_device_scsi(struct msc_device *dev,
+			   const uint8_t *cdb, int cdb_length,
+			   bool data_in, void *data, uint32_t length);
+extern int msc_device_sync(struct msc_device *dev);
+extern int msc_device_eject(struct msc_device *dev);
+extern int msc_device_flash_write(struct msc_device *dev, uint32_t offset,
+				  const void *data, uint32_t length);
+extern int msc_device_flash_erase(struct msc_device *dev, uint32_t offset,
+				  uint32_t length);
+extern int msc_device_flash_crc(struct msc_device *dev, uint32_t offset,
+				uint32_t length, uint32_t *crc);
+extern int msc_device_reboot(struct msc_device *dev);
+extern int msc_device_flash_journal(struct msc_device *dev, uint32_t key,
+				    struct msc_journal *journal);
+extern bool msc_journal_page(const struct msc_journal *journal,
+			     uint32_t page, uint32_t *crc);
+extern int msc_device_buffer_stats(struct msc_device *dev,
+				   struct msc_buffer_stats *stats);
+extern int msc_device_pipeline_stats(struct msc_device *dev,
+				     struct msc_pipeline_stats *stats);
+extern uint32_t msc_crc32(const uint8_t *data, uint32_t length);
+extern double msc_now(void);
+
+#endif